@@ -5,8 +5,12 @@
 #define __IOBASE_H__ 1
 
 #define MMIO_MAP_BASE   0xF0000000
+#define MMIO_MAP_SIZE   0x09000000
 #define KLOG_BASE       0xCC000000
 #define MMU_BASE        0xC8000000
+#define MMU_SIZE        0x04000000
+#define KSTACK_BASE     0xC4000000
+#define KSTACK_SIZE     0x04000000
 
 #define INITRD_BASE     0xF9000000
 #define INITRD_SIZE     0x4000000
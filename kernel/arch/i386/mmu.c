@@ -22,6 +22,8 @@
 
 #include <common/mm/liballoc.h>
 #include <common/mm/mm.h>
+#include <common/mm/vma.h>
+#include <common/mm/vmem.h>
 #include <common/tty/tty.h>
 #include <common/util/kfuncs.h>
 
@@ -63,8 +65,19 @@ enum {
     PTT_SHIFT = 12+(10*0),
     PDE_MASK  = 0x003FF,
     PTE_MASK  = 0xFFFFF,
+    LARGE_PAGE_SIZE = 1 << PDT_SHIFT,   // 4MiB (PDE.PS, CR4.PSE is set at boot)
+    TEMP_PDE = 1022,                    // Recursive mapping of the temp context
+    RECURSIVE_PDE = 1023,
 };
 
+// In large page entries, the PAT bit moves to bit 12 (bit 0 of the frame)
+#define LARGE_PAT_BIT 1UL
+
+// Number of pages past which the whole TLB gets flushed instead
+#define FLUSH_THRESHOLD 32
+
+#define CR4_PGE (1UL << 7)
+
 static uint32_t temp_map_base         =                 0xFF800000;
 static bool using_temp_map = false;
 
@@ -73,12 +86,59 @@ static paging_context_t* temp_context;
 static paging_context_t initial_context;
 
 static uint32_t temp_remap_offset     =                 0x00400000;
+static uint32_t const kernel_space_base =               0x80000000;
 static page_entry_t* const pde_lookup = (page_entry_t*) 0xFFFFF000;
 static page_entry_t* const pte_lookup = (page_entry_t*) 0xFFC00000;
 
 static void invlpg(void* address)
 {
-    asm volatile("invlpg (%%eax)" : "=a"(address));
+    asm volatile("invlpg (%%eax)" :: "a"(address) : "memory");
+}
+
+static void flush_tlb()
+{
+    asm volatile("movl %%cr3, %%eax\n\t"
+                 "movl %%eax, %%cr3\n\t" ::: "eax", "memory");
+}
+
+// Flushes every entry, including global ones
+static void flush_global()
+{
+    // Toggling PGE flushes the entire TLB
+    asm volatile("movl %%cr4, %%eax\n\t"
+                 "xorl %%edx, %%eax\n\t"
+                 "movl %%eax, %%cr4\n\t"
+                 "xorl %%edx, %%eax\n\t"
+                 "movl %%eax, %%cr4\n\t" :: "d"(CR4_PGE) : "eax", "memory");
+}
+
+/**
+ * Kernel space mappings are shared by every context, so they are made global.
+ * The temporary and recursive mappings are different in each context, so they aren't
+ */
+static bool is_global_address(void* address)
+{
+    return (uintptr_t)address >= kernel_space_base && (uintptr_t)address < temp_map_base;
+}
+
+// Invalidates the range of pages, or the entire TLB if it is cheaper
+static void flush_range(uintptr_t base, uintptr_t end)
+{
+    // Entries of other address spaces aren't in the TLB
+    if(using_temp_map)
+        return;
+
+    if(((end - base) >> 12) > FLUSH_THRESHOLD)
+    {
+        if(is_global_address((void*)base))
+            flush_global();
+        else
+            flush_tlb();
+        return;
+    }
+
+    for(; base < end; base += PAGE_SIZE)
+        invlpg((void*)base);
 }
 
 static page_entry_t* get_lookup(page_entry_t* base)
@@ -101,6 +161,33 @@ static page_entry_t* get_pte_entry(void* address)
     return &(get_lookup(pte_lookup)[pte_off]);
 }
 
+static bool is_large_entry(page_entry_t* entry)
+{
+    // The page size bit of a PDE is in the same place as the PTE PAT bit
+    return entry->pat;
+}
+
+/**
+ * Gets the entry that maps the address, which may be a PTE, or a PDE
+ * when mapped by a large page. Returns NULL if the PDE is not present
+ */
+static page_entry_t* get_leaf_entry(void* address, size_t* page_size)
+{
+    page_entry_t* entry = get_pde_entry(address);
+
+    if(entry->p == 0)
+        return NULL;
+
+    if(is_large_entry(entry))
+    {
+        *page_size = LARGE_PAGE_SIZE;
+        return entry;
+    }
+
+    *page_size = PAGE_SIZE;
+    return get_pte_entry(address);
+}
+
 // Returns true if a new structure was allocated, false otherwise.
 static bool check_and_map_entry(page_entry_t* entry, void* address, uint32_t flags)
 {
@@ -138,11 +225,20 @@ void pf_handler(struct intr_stack *frame, void* args)
     struct PageError *page_error = (struct PageError*)&(frame->err_code);
     void* address = (void*)frame->cr2;
 
+    uint32_t access = MMU_ACCESS_R;
+    access |= page_error->was_write ? MMU_ACCESS_W : 0;
+    access |= page_error->was_user ? MMU_ACCESS_USER : 0;
+
+    // Fault in reserved pages on their first access, and copy shared pages on writes
+    if(vma_handle_fault(address, access, page_error->was_present))
+        return;
+
     page_entry_t dummy_entry = {};
     memset(&dummy_entry, 0, sizeof(page_entry_t));
 
-    page_entry_t* entry = get_pte_entry(address);
-    if(!get_pde_entry(address)->p)
+    size_t page_size;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+    if(entry == NULL)
         entry = &dummy_entry;
 
     kpanic_intr(frame, "Page fault at %#p (error code PWU: %d%d%d, PG PWU: %d%d%d)", address,
@@ -159,6 +255,7 @@ void mmu_init()
         : "=a"(cr3));
     
     initial_context.phybase = (uint64_t)cr3;
+    initial_context.switch_base = cr3;
     current_context = &initial_context;
     
     // Get rid of Identity Mapping
@@ -171,14 +268,40 @@ void mmu_init()
     isr_add_handler(14, pf_handler, NULL);
 }
 
-int mmu_map(void* address, unsigned long mapping, uint32_t flags)
+static int get_pat_index(uint32_t flags)
 {
-    int status = 0;
+    // TODO: Check for PAT support
+    switch(flags & MMU_CACHE_MASK)
+    {
+        case MMU_CACHE_WB:  return 0b000;
+        case MMU_CACHE_WT:  return 0b001;
+        // case MMU_CACHE_UCO: return 0b010;
+        case MMU_CACHE_UC:  return 0b011;
+        // case MMU_CACHE_WC:  return 0b100;
+        // case MMU_CACHE_WP:  return 0b111;
+        default:
+            return MMU_MAPPING_NOT_CAPABLE;
+    }
+}
 
-    if(mapping == (unsigned long)KNULL || address == KNULL)
-        return MMU_MAPPING_INVAL;
+static void set_entry_attr(page_entry_t* entry, void* address, uint32_t flags, uint8_t pat_index, bool large_page)
+{
+    entry->p =  (flags & MMU_ACCESS_R) >> 0;
+    entry->rw = (flags & MMU_ACCESS_W) >> 1;
+    entry->su = (flags & MMU_ACCESS_USER) >> 3;
+    entry->g =  is_global_address(address);
+    entry->pwt = (pat_index >> 0) & 1;
+    entry->pcd = (pat_index >> 1) & 1;
+
+    if(large_page)
+        entry->frame = (entry->frame & ~LARGE_PAT_BIT) | ((pat_index >> 2) & 1);
+    else
+        entry->pat = (pat_index >> 2) & 1;
+}
 
-    // Check PDE Presence
+// Makes sure the page table for the address exists
+static int map_table(void* address, uint32_t flags)
+{
     if(check_and_map_entry(get_pde_entry(address), address, flags | MMU_ACCESS_W))
     {
         uint64_t pte_base = ((uintptr_t)address >> PTT_SHIFT) & (PTE_MASK & ~0x3FF);
@@ -186,6 +309,23 @@ int mmu_map(void* address, unsigned long mapping, uint32_t flags)
     }
     else if(get_pde_entry(address)->frame == KMEM_POISON)
         return MMU_MAPPING_ERROR;
+    else if(is_large_entry(get_pde_entry(address)))
+        return MMU_MAPPING_EXISTS;
+
+    return 0;
+}
+
+int mmu_map(void* address, unsigned long mapping, uint32_t flags)
+{
+    int status = 0;
+
+    if(mapping == (unsigned long)KNULL || address == KNULL)
+        return MMU_MAPPING_INVAL;
+
+    // Check PDE Presence
+    status = map_table(address, flags);
+    if(status != 0)
+        return status;
 
     // Check if we are trying to map to an already mapped address
     if(get_pte_entry(address)->p)
@@ -199,77 +339,282 @@ int mmu_map(void* address, unsigned long mapping, uint32_t flags)
     return status;
 }
 
-int mmu_change_attr(void* address, uint32_t flags)
+// Maps a 4MiB page
+static int map_large(void* address, unsigned long mapping, uint32_t flags)
 {
-    // TODO: Check for PAT support
-    uint8_t pat_index = 0;
+    page_entry_t* entry = get_pde_entry(address);
 
-    if( get_pde_entry(address)->p == 0)
-        return MMU_MAPPING_ERROR;
+    // Don't replace an existing mapping or page table
+    if(entry->p || entry->frame != 0)
+        return MMU_MAPPING_EXISTS;
 
-    // Set up caching flags
-    switch(flags & MMU_CACHE_MASK)
+    entry->frame = mapping >> 12;
+    entry->pat = 1; // Page size bit
+    set_entry_attr(entry, address, flags, get_pat_index(flags), true);
+
+    return 0;
+}
+
+// Maps the 4KiB pages up to the end of the page table that base is in
+static int map_small(uintptr_t* base, unsigned long* mapping, uintptr_t end, uint32_t flags)
+{
+    uintptr_t table_end = (*base | (LARGE_PAGE_SIZE - 1)) + 1;
+    page_entry_t* entry;
+    int status = 0;
+
+    status = map_table((void*)*base, flags);
+    if(status != 0)
+        return status;
+
+    if(table_end > end || table_end == 0)
+        table_end = end;
+
+    // PTEs in the same table are next to each other in the lookup
+    for(entry = get_pte_entry((void*)*base); *base < table_end; *base += PAGE_SIZE, *mapping += PAGE_SIZE, entry++)
     {
-        case MMU_CACHE_WB:  pat_index = 0b000; break;
-        case MMU_CACHE_WT:  pat_index = 0b001; break;
-        // case MMU_CACHE_UCO: pat_index = 0b010; break;
-        case MMU_CACHE_UC:  pat_index = 0b011; break;
-        // case MMU_CACHE_WC:  pat_index = 0b100; break;
-        // case MMU_CACHE_WP:  pat_index = 0b111; break;
-        default:
-            return MMU_MAPPING_NOT_CAPABLE;
+        if(entry->p)
+            return MMU_MAPPING_EXISTS;
+
+        entry->frame = *mapping >> 12;
+        set_entry_attr(entry, (void*)*base, flags, get_pat_index(flags), false);
     }
 
-    get_pte_entry(address)->p =  (flags & MMU_ACCESS_R) >> 0;
-    get_pte_entry(address)->rw = (flags & MMU_ACCESS_W) >> 1;
-    get_pte_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
-    get_pte_entry(address)->pwt = (pat_index >> 0) & 1;
-    get_pte_entry(address)->pcd = (pat_index >> 1) & 1;
-    get_pte_entry(address)->pat = (pat_index >> 2) & 1;
+    return 0;
+}
+
+int mmu_map_range(void* address, unsigned long mapping, size_t size, uint32_t flags)
+{
+    if(mapping == (unsigned long)KNULL || address == KNULL)
+        return MMU_MAPPING_INVAL;
+
+    if(get_pat_index(flags) < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+    mapping &= ~PAGE_MASK;
+
+    // Entries only go from not present to present, so nothing needs to be flushed
+    while(base < end)
+    {
+        int status = MMU_MAPPING_EXISTS;
+
+        // Use a large page if it fits, falling back to small ones where a page table already exists
+        if(((base | mapping) & (LARGE_PAGE_SIZE - 1)) == 0 && end - base >= LARGE_PAGE_SIZE)
+            status = map_large((void*)base, mapping, flags);
+
+        if(status == 0)
+        {
+            base += LARGE_PAGE_SIZE;
+            mapping += LARGE_PAGE_SIZE;
+        }
+        else if(status == MMU_MAPPING_EXISTS)
+        {
+            status = map_small(&base, &mapping, end, flags);
+        }
+
+        if(status != 0)
+            return status;
+    }
+
+    return 0;
+}
+
+int mmu_change_attr(void* address, uint32_t flags)
+{
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+    int pat_index = get_pat_index(flags);
+
+    if(entry == NULL)
+        return MMU_MAPPING_ERROR;
+
+    if(pat_index < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    set_entry_attr(entry, address, flags, pat_index, page_size != PAGE_SIZE);
     invlpg(address);
 
     return 0;
 }
 
+int mmu_protect_range(void* address, size_t size, uint32_t flags)
+{
+    int pat_index = get_pat_index(flags);
+    int status = 0;
+
+    if(pat_index < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    while(base < end)
+    {
+        size_t page_size = PAGE_SIZE;
+        page_entry_t* entry = get_leaf_entry((void*)base, &page_size);
+
+        // The page directory is walked once for every table
+        uintptr_t table_end = (base | (LARGE_PAGE_SIZE - 1)) + 1;
+        if(table_end > end || table_end == 0)
+            table_end = end;
+
+        if(entry == NULL)
+            status = MMU_MAPPING_ERROR;
+        else if(page_size != PAGE_SIZE)
+            set_entry_attr(entry, (void*)base, flags, pat_index, true);  // The whole large page is changed
+        else
+        {
+            for(uintptr_t page = base; page < table_end; page += PAGE_SIZE, entry++)
+            {
+                // Leave holes in the range unmapped
+                if(entry->p)
+                    set_entry_attr(entry, (void*)page, flags, pat_index, false);
+            }
+        }
+
+        base = table_end;
+    }
+
+    flush_range((uintptr_t)address & ~PAGE_MASK, end);
+    return status;
+}
+
 bool mmu_unmap(void* address, bool erase)
 {
-    if( get_pde_entry(address)->p == 0 ||
-        get_pte_entry(address)->p == 0) return false;
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
 
-    get_pte_entry(address)->p = 0;
+    if( entry == NULL ||
+        entry->p == 0) return false;
+
+    if(page_size != PAGE_SIZE)
+    {
+        // Large pages are always erased, as a non-present entry with a frame is treated as a page table
+        memset(entry, 0, sizeof(page_entry_t));
+        invlpg(address);
+        return true;
+    }
+
+    entry->p = 0;
 
     if(erase)
     {
         mmu_change_attr(address, 0);
-        get_pte_entry(address)->frame = KMEM_POISON >> 12;
+        entry->frame = KMEM_POISON >> 12;
     }
 
     invlpg(address);
     return true;
 }
 
+void mmu_unmap_range(void* address, size_t size, bool erase)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    while(base < end)
+    {
+        size_t page_size = PAGE_SIZE;
+        page_entry_t* entry = get_leaf_entry((void*)base, &page_size);
+
+        // The page directory is walked once for every table
+        uintptr_t table_end = (base | (LARGE_PAGE_SIZE - 1)) + 1;
+        if(table_end > end || table_end == 0)
+            table_end = end;
+
+        if(entry != NULL && page_size != PAGE_SIZE)
+        {
+            // Large pages are always erased, as a non-present entry with a frame is treated as a page table
+            memset(entry, 0, sizeof(page_entry_t));
+        }
+        else if(entry != NULL)
+        {
+            for(uintptr_t page = base; page < table_end; page += PAGE_SIZE, entry++)
+            {
+                entry->p = 0;
+
+                if(erase)
+                {
+                    memset(entry, 0, sizeof(page_entry_t));
+                    entry->frame = KMEM_POISON >> 12;
+                }
+            }
+        }
+
+        base = table_end;
+    }
+
+    flush_range((uintptr_t)address & ~PAGE_MASK, end);
+}
+
 unsigned long mmu_get_mapping(void* address)
 {
-    if( get_pde_entry(address)->p == 0)
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+
+    if(entry == NULL)
         return 0;
 
-    return get_pte_entry(address)->frame << 12;
+    if(page_size == PAGE_SIZE)
+        return entry->frame << 12;
+
+    // Give the address of the 4KiB page inside of the large page
+    return ((entry->frame & ~LARGE_PAT_BIT) << 12) + ((uintptr_t)address & (page_size - 1) & ~PAGE_MASK);
 }
 
 bool mmu_check_access(void* address, uint32_t flags)
 {
-    if( get_pde_entry(address)->p == 0)
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+
+    if(entry == NULL)
         return false;
 
     uint32_t entry_flags = 0;
-    entry_flags |= (get_pte_entry(address)->p  << 0);
-    entry_flags |= (get_pte_entry(address)->rw << 1);
-    entry_flags |= (                         1 << 2);       // i386 doesn't have NX in non-PAE mode
-    entry_flags |= (get_pte_entry(address)->su << 3);
+    entry_flags |= (entry->p  << 0);
+    entry_flags |= (entry->rw << 1);
+    entry_flags |= (        1 << 2);       // i386 doesn't have NX in non-PAE mode
+    entry_flags |= (entry->su << 3);
 
     return (entry_flags & flags) == flags;
 }
 
+void* mmu_next_mapped(void* address, void* end)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t skip;
+
+    while(base < (uintptr_t)end)
+    {
+        // Skip over whole page tables that aren't present
+        if(get_pde_entry((void*)base)->p == 0)
+            skip = LARGE_PAGE_SIZE;
+        else if(is_large_entry(get_pde_entry((void*)base)) || get_pte_entry((void*)base)->p)
+            return (void*)base;
+        else
+            skip = PAGE_SIZE;
+
+        // Stop if the skip wraps around the address space
+        if(((base & ~(skip - 1)) + skip) <= base)
+            break;
+
+        base = (base & ~(skip - 1)) + skip;
+    }
+
+    return end;
+}
+
+void mmu_map_direct(unsigned long base, size_t length)
+{
+    // There isn't enough address space for a direct map
+}
+
+void* mmu_phys_to_virt(unsigned long address)
+{
+    return KNULL;
+}
+
 void* mm_get_base()
 {
     return (void*) MMU_BASE;
@@ -280,29 +625,66 @@ paging_context_t* mmu_create_context()
     // Create page context base
     unsigned long pdt_context = mm_alloc(1);
 
-    // Map context to temporary address
-    mmu_map((void*)temp_map_base, pdt_context, MMU_ACCESS_RW | MMU_CACHE_WB);
-    memset((void*)temp_map_base, 0x00, 0x1000);
+    // Map context to a scratch address
+    page_entry_t *pde_temp_lookup = vmem_alloc(&io_arena, PAGE_SIZE);
+    mmu_map(pde_temp_lookup, pdt_context, MMU_ACCESS_RW | MMU_CACHE_WB);
+    memset(pde_temp_lookup, 0x00, 0x1000);
 
     // Copy relavent mappings to address space (Excluding temporary and recursive mapping)
-    memcpy((uint8_t*)temp_map_base+2048, (uint8_t*)pde_lookup+2048, 2048-16);
+    memcpy(&pde_temp_lookup[512], &pde_lookup[512], (TEMP_PDE - 512) * sizeof(page_entry_t));
 
     // Change recursive mapping entry
-    page_entry_t *pde_temp_lookup = (page_entry_t*)temp_map_base;
-    pde_temp_lookup[511].frame = pdt_context >> 12ULL;
-    pde_temp_lookup[511].rw = 1;
-    pde_temp_lookup[511].p = 1;
+    pde_temp_lookup[RECURSIVE_PDE].frame = pdt_context >> 12ULL;
+    pde_temp_lookup[RECURSIVE_PDE].rw = 1;
+    pde_temp_lookup[RECURSIVE_PDE].p = 1;
 
     paging_context_t *context = kmalloc(sizeof(paging_context_t));
     context->phybase = pdt_context;
+    context->switch_base = pdt_context;     // No PCIDs in 32-bit paging
+    context->asid = 0;
+    context->tlb_stale = true;
 
-    mmu_unmap((void*)temp_map_base, true);
+    mmu_unmap(pde_temp_lookup, true);
+    vmem_free(&io_arena, pde_temp_lookup, PAGE_SIZE);
     return context;
 }
 
 void mmu_destroy_context(paging_context_t* context)
 {
     if(context == KNULL) return;
+
+    if(context == current_context || context == &initial_context)
+        kpanic("Tried to destroy an active address space");
+
+    // Only the user half is owned by the context, as the kernel half is shared
+    mmu_set_temp_context(context);
+
+    for(uintptr_t address = 0; address < kernel_space_base; address += LARGE_PAGE_SIZE)
+    {
+        page_entry_t* pde = get_pde_entry((void*)address);
+
+        // Large pages only map device memory, which isn't owned by the context
+        if(!pde->p || is_large_entry(pde))
+            continue;
+
+        for(uintptr_t page = address; page < address + LARGE_PAGE_SIZE; page += PAGE_SIZE)
+        {
+            page_entry_t* pte = get_pte_entry((void*)page);
+
+            if(pte->p)
+                mm_free((unsigned long)pte->frame << 12, 1);
+        }
+
+        mm_free((unsigned long)pde->frame << 12, 1);
+    }
+
+    mmu_exit_temp_context();
+
+    // Unhook the context from the temporary mapping
+    memset(&pde_lookup[TEMP_PDE], 0, sizeof(page_entry_t));
+    flush_tlb();
+    temp_context = NULL;
+
     mm_free(context->phybase, 1);
     kfree(context);
 }
@@ -326,15 +708,16 @@ void mmu_set_temp_context(paging_context_t* addr_context)
         return;
     }
 
-    if(temp_context != addr_context)
-    {
-        // Change the context to the new one
-        temp_context = addr_context;
+    // The entry is in the current context, so it is always overwritten
+    temp_context = addr_context;
 
-        // Overwrite the temporary mapping entry
-        pde_lookup[510].frame = temp_context->phybase >> 12ULL;
-        invlpg(&(pde_lookup[510]));
-    }
+    // Overwrite the temporary mapping entry
+    pde_lookup[TEMP_PDE].frame = temp_context->phybase >> 12ULL;
+    pde_lookup[TEMP_PDE].rw = 1;
+    pde_lookup[TEMP_PDE].p = 1;
+
+    // All of the old context's tables are still in the TLB
+    flush_tlb();
 
     using_temp_map = true;
 }
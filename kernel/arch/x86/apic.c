@@ -2,12 +2,13 @@
 
 #include <arch/apic.h>
 #include <arch/idt.h>
-#include <arch/iobase.h>
 
 #include <common/hal.h>
 #include <common/mm/mm.h>
 #include <common/mm/liballoc.h>
+#include <common/mm/vmem.h>
 #include <common/sched/sched.h>
+#include <common/util/kfuncs.h>
 #include <common/util/klog.h>
 
 #define APIC_EOIR       0xB0
@@ -90,9 +91,8 @@ static const char* apic_delmode_names[] =
     "ExtInt",
 };
 
-// TODO: Replace with a real IO Space virtual mem allocator
-void* apic_map = (void*)(MMIO_MAP_BASE + 0x08000000);
-void* ioapic_map = (void*)(MMIO_MAP_BASE + 0x08001000);
+void* apic_map = KNULL;
+void* ioapic_map = KNULL;
 static struct ioapic_dev main_ioapic = {};
 static struct irq_mapping* mapping_head = NULL;
 static struct irq_mapping* mapping_tail = NULL;
@@ -148,7 +148,9 @@ void apic_init(uint64_t phybase)
 {
     klog_logln(LVL_INFO, "Initializing APIC @ %p", phybase);
 
-    mmu_map(apic_map, (uintptr_t)phybase, MMU_ACCESS_RW | MMU_CACHE_UC);
+    apic_map = ioremap((uintptr_t)phybase, PAGE_SIZE, MMU_ACCESS_RW | MMU_CACHE_UC);
+    if(apic_map == KNULL)
+        kpanic("Unable to map the APIC");
 
     // Enable LAPIC && Set SIV to FF
     apic_write(APIC_SIVR, apic_read(APIC_SIVR) | 0x1FF);
@@ -198,7 +200,9 @@ void ioapic_init(uint64_t phybase, uint32_t irq_base)
 
     memset(&main_ioapic, 0, sizeof(struct ioapic_dev));
 
-    mmu_map(ioapic_map, phybase, MMU_ACCESS_RW | MMU_CACHE_UC);
+    ioapic_map = ioremap(phybase, PAGE_SIZE, MMU_ACCESS_RW | MMU_CACHE_UC);
+    if(ioapic_map == KNULL)
+        kpanic("Unable to map the IOAPIC");
     main_ioapic.address = ioapic_map;
     main_ioapic.irq_base = irq_base;
     main_ioapic.redirect_len = ((ioapic_read(ioapic_map, 1) >> 16) & IOAPIC_REDIR_VEC) + 1;
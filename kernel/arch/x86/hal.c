@@ -24,6 +24,7 @@
 #include <common/acpi.h>
 #include <common/hal/timer.h>
 #include <common/mm/liballoc.h>
+#include <common/mm/mm.h>
 #include <common/sched/sched.h>
 #include <common/util/kfuncs.h>
 
@@ -39,6 +40,7 @@
 //TODO: Breakup HAL into more subsystems
 
 #define KLOG_FATAL(msg, ...) klog_logln(LVL_FATAL, msg, __VA_ARGS__);
+#define MAX_APIC_IDS 256
 
 extern void halt();
 
@@ -55,6 +57,13 @@ static struct heap_info heap_context = {
 static struct ic_dev* default_ic;
 static uint8_t ic_mode = IC_MODE_PIC;
 
+// NUMA node of each cpu, indexed by APIC id
+static uint8_t cpu_nodes[MAX_APIC_IDS];
+static uint8_t bsp_apic_id = 0;
+// Proximity domain of each node
+static uint32_t node_domains[MM_MAX_NODES];
+static unsigned int num_nodes = 0;
+
 static bool apic_exists()
 {
     uint32_t edx;
@@ -85,8 +94,128 @@ static ACPI_SUBTABLE_HEADER* madt_find_table(ACPI_TABLE_MADT* madt, uint8_t Type
     return NULL;
 }
 
+/**
+ * @brief  Gets the node id for the proximity domain
+ * @param  domain: The proximity domain from the SRAT
+ * @param  allocate: If a new node id should be given out for unknown domains
+ * @retval The node id, or MM_MAX_NODES if there is none
+ */
+static unsigned int domain_to_node(uint32_t domain, bool allocate)
+{
+    for(unsigned int i = 0; i < num_nodes; i++)
+    {
+        if(node_domains[i] == domain)
+            return i;
+    }
+
+    if(!allocate || num_nodes >= MM_MAX_NODES)
+        return MM_MAX_NODES;
+
+    node_domains[num_nodes] = domain;
+    return num_nodes++;
+}
+
+static void set_cpu_node(uint32_t apic_id, uint32_t domain)
+{
+    unsigned int node = domain_to_node(domain, true);
+
+    if(apic_id < MAX_APIC_IDS && node < MM_MAX_NODES)
+        cpu_nodes[apic_id] = node;
+}
+
+static void numa_init()
+{
+    uint32_t ebx;
+    asm volatile("cpuid":"=b"(ebx):"a"(1):"ecx","edx");
+    bsp_apic_id = ebx >> 24;
+
+    ACPI_TABLE_SRAT* srat = (ACPI_TABLE_SRAT*)acpi_early_get_table(ACPI_SIG_SRAT, 1);
+
+    // Without a SRAT, everything stays on node 0
+    if(srat == NULL)
+        return;
+
+    ACPI_SUBTABLE_HEADER* entry = (ACPI_SUBTABLE_HEADER*)(srat + 1);
+    uint32_t len = srat->Header.Length - sizeof(ACPI_TABLE_SRAT);
+
+    while(len >= sizeof(ACPI_SUBTABLE_HEADER) && entry->Length != 0 && entry->Length <= len)
+    {
+        switch(entry->Type)
+        {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY:
+            {
+                ACPI_SRAT_CPU_AFFINITY* cpu = (ACPI_SRAT_CPU_AFFINITY*)entry;
+                uint32_t domain = cpu->ProximityDomainLo;
+
+                // The upper bits of the domain are only valid from revision 2
+                if(srat->Header.Revision >= 2)
+                {
+                    domain |= (uint32_t)cpu->ProximityDomainHi[0] << 8;
+                    domain |= (uint32_t)cpu->ProximityDomainHi[1] << 16;
+                    domain |= (uint32_t)cpu->ProximityDomainHi[2] << 24;
+                }
+
+                if(cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY)
+                    set_cpu_node(cpu->ApicId, domain);
+                break;
+            }
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY:
+            {
+                ACPI_SRAT_X2APIC_CPU_AFFINITY* cpu = (ACPI_SRAT_X2APIC_CPU_AFFINITY*)entry;
+
+                if(cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY)
+                    set_cpu_node(cpu->ApicId, cpu->ProximityDomain);
+                break;
+            }
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY:
+            {
+                ACPI_SRAT_MEM_AFFINITY* mem = (ACPI_SRAT_MEM_AFFINITY*)entry;
+
+                // Disabled entries (e.g. hot-pluggable memory) don't get a node
+                if(!(mem->Flags & ACPI_SRAT_MEM_ENABLED))
+                    break;
+
+                unsigned int node = domain_to_node(mem->ProximityDomain, true);
+
+                if(node < MM_MAX_NODES)
+                    mm_set_node(mem->BaseAddress, mem->Length, node);
+                break;
+            }
+        }
+
+        len -= entry->Length;
+        entry = (ACPI_SUBTABLE_HEADER*)((uintptr_t)entry + entry->Length);
+    }
+
+    acpi_put_table((ACPI_TABLE_HEADER*)srat);
+
+    ACPI_TABLE_SLIT* slit = (ACPI_TABLE_SLIT*)acpi_early_get_table(ACPI_SIG_SLIT, 1);
+
+    if(slit != NULL)
+    {
+        // The SLIT is indexed by proximity domain
+        for(uint64_t from = 0; from < slit->LocalityCount; from++)
+        {
+            for(uint64_t to = 0; to < slit->LocalityCount; to++)
+            {
+                unsigned int from_node = domain_to_node(from, false);
+                unsigned int to_node = domain_to_node(to, false);
+
+                if(from_node < MM_MAX_NODES && to_node < MM_MAX_NODES)
+                    mm_set_node_distance(from_node, to_node, slit->Entry[from * slit->LocalityCount + to]);
+            }
+        }
+
+        acpi_put_table((ACPI_TABLE_HEADER*)slit);
+    }
+
+    klog_logln(LVL_INFO, "NUMA: %d nodes, BSP on node %d", num_nodes, cpu_nodes[bsp_apic_id]);
+}
+
 void hal_init()
 {
+    numa_init();
+
     ACPI_TABLE_MADT* madt = (ACPI_TABLE_MADT*)acpi_early_get_table(ACPI_SIG_MADT, 1);
 
     if(madt != NULL)
@@ -244,6 +373,12 @@ struct heap_info* get_heap_info()
     return &heap_context;
 }
 
+unsigned int hal_get_cpu_node()
+{
+    // TODO: Use the current cpu's APIC id when doing SMP
+    return cpu_nodes[bsp_apic_id];
+}
+
 void* get_klog_base()
 {
     return (void*)KLOG_BASE;
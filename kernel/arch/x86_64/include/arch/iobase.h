@@ -5,8 +5,14 @@
 #define __IOBASE_H__ 1
 
 #define MMIO_MAP_BASE   0xFFFFF00000000000
+#define MMIO_MAP_SIZE   0x00000E0000000000
 #define KLOG_BASE       0xFFFF8C0000000000
+#define KSTACK_BASE     0xFFFF8E0000000000
+#define KSTACK_SIZE     0x0000020000000000
 #define MMU_BASE        0xFFFF880000000000
+#define MMU_SIZE        0x0000040000000000
+#define DIRECT_MAP_BASE 0xFFFFA00000000000
+#define DIRECT_MAP_SIZE 0x0000400000000000
 
 #define INITRD_BASE     0xFFFFFEFFFC000000
 #define INITRD_SIZE     0x4000000
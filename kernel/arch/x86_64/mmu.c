@@ -23,6 +23,7 @@
 #include <common/util/kfuncs.h>
 #include <common/mm/liballoc.h>
 #include <common/mm/mm.h>
+#include <common/mm/vma.h>
 #include <common/tty/fb.h>
 #include <common/tty/tty.h>
 
@@ -74,58 +75,196 @@ enum {
     PDPE_MASK  = 0x00003FFFF,
     PDE_MASK   = 0x007FFFFFF,
     PTE_MASK   = 0xFFFFFFFFF,
+    LARGE_PAGE_SIZE = 1 << PDT_SHIFT,   // 2MiB (PDE.PS)
+    HUGE_PAGE_SIZE  = 1 << PDPT_SHIFT,  // 1GiB (PDPE.PS)
 };
 
+// In large page entries, the PAT bit moves to bit 12 (bit 0 of the frame)
+#define LARGE_PAT_BIT 1ULL
+
+// Number of pages past which the whole TLB gets flushed instead
+#define FLUSH_THRESHOLD 32
+
+#define PCID_COUNT 4096
+#define ASID_NONE 0xFFFF
+#define CR3_NO_FLUSH (1ULL << 63)
+#define CR4_PGE (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
 static uint64_t temp_map_base =                             0xFFFFFF0000000000;
 static bool using_temp_map = false;
 
 static paging_context_t* current_context;
 static paging_context_t* temp_context;
 static paging_context_t initial_context;
+static bool has_huge_pages = false;
+static bool has_direct_map = false;
+
+// PCID 0 always belongs to the initial context
+static bool has_pcid = false;
+static bool has_invpcid = false;
+static paging_context_t* pcid_owners[PCID_COUNT];
+static uint16_t next_pcid = 1;
 
-static uint64_t const temp_remap_offset =                    0x0000008000000000;
 static page_entry_t* const pml4e_lookup = (page_entry_t*)    0xFFFFFFFFFFFFF000;
 static page_entry_t* const pdpe_lookup  = (page_entry_t*)    0xFFFFFFFFFFE00000;
 static page_entry_t* const pde_lookup   = (page_entry_t*)    0xFFFFFFFFC0000000;
 static page_entry_t* const pte_lookup   = (page_entry_t*)    0xFFFFFF8000000000;
 
+// Also drops global entries, no matter which PCID is loaded
 static void invlpg(void* address)
 {
     asm volatile("invlpg (%%rax)" :: "a"(address));
 }
 
-static page_entry_t* get_lookup(page_entry_t* base)
+static void invpcid(uint64_t type, uint16_t pcid, void* address)
+{
+    struct { uint64_t pcid; void* address; } descriptor = { pcid, address };
+    asm volatile("invpcid (%%rax), %%rcx" :: "a"(&descriptor), "c"(type) : "memory");
+}
+
+static void flush_tlb()
+{
+    asm volatile("movq %%cr3, %%rax\n\t"
+                 "movq %%rax, %%cr3\n\t" ::: "rax", "memory");
+}
+
+// Flushes every entry, including global ones
+static void flush_global()
 {
-    if(using_temp_map) return (page_entry_t*)((uintptr_t)base - temp_remap_offset);
-    else return base;
+    if(has_invpcid)
+    {
+        invpcid(2, 0, NULL);
+        return;
+    }
+
+    // Toggling PGE flushes the entire TLB
+    asm volatile("movq %%cr4, %%rax\n\t"
+                 "xorq %%rdx, %%rax\n\t"
+                 "movq %%rax, %%cr4\n\t"
+                 "xorq %%rdx, %%rax\n\t"
+                 "movq %%rax, %%cr4\n\t" :: "d"(CR4_PGE) : "rax", "memory");
+}
+
+/**
+ * Kernel space mappings are shared by every context, so they are made global.
+ * The temporary and recursive mappings are different in each context, so they aren't
+ */
+static bool is_global_address(void* address)
+{
+    return (intptr_t)address < 0 && (uintptr_t)address < temp_map_base;
+}
+
+// Invalidates the range of pages, or the entire TLB if it is cheaper
+static void flush_range(uintptr_t base, uintptr_t end)
+{
+    // Entries of other address spaces aren't in the TLB, but the kernel half is shared by all of them
+    if(using_temp_map && !is_global_address((void*)base))
+        return;
+
+    if(((end - base) >> 12) > FLUSH_THRESHOLD)
+    {
+        if(is_global_address((void*)base))
+            flush_global();
+        else
+            flush_tlb();
+        return;
+    }
+
+    for(; base < end; base += PAGE_SIZE)
+        invlpg((void*)base);
+}
+
+/*
+ * The tables of the current context are reached through the recursive mapping,
+ * while the temp context's tables are walked through the direct map
+ */
+static page_entry_t* get_direct_entry(page_entry_t* parent, void* address, unsigned shift)
+{
+    page_entry_t* table = (page_entry_t*)(DIRECT_MAP_BASE + (parent->frame << 12));
+
+    return &(table[((uintptr_t)address >> shift) & 0x1FF]);
 }
 
 static page_entry_t* get_pml4e_entry(void* address)
 {
     uint64_t pml4e_off = ((uintptr_t)address >> PML4_SHIFT) & PML4E_MASK;
 
-    return &(get_lookup(pml4e_lookup)[pml4e_off]);
+    if(using_temp_map)
+        return &((page_entry_t*)(DIRECT_MAP_BASE + temp_context->phybase))[pml4e_off];
+
+    return &(pml4e_lookup[pml4e_off]);
 }
 
 static page_entry_t* get_pdpe_entry(void* address)
 {
     uint64_t pdpe_off = ((uintptr_t)address >> PDPT_SHIFT) & PDPE_MASK;
 
-    return &(get_lookup(pdpe_lookup)[pdpe_off]);
+    if(using_temp_map)
+        return get_direct_entry(get_pml4e_entry(address), address, PDPT_SHIFT);
+
+    return &(pdpe_lookup[pdpe_off]);
 }
 
 static page_entry_t* get_pde_entry(void* address)
 {
     uint64_t pde_off = ((uintptr_t)address >> PDT_SHIFT) & PDE_MASK;
 
-    return &(get_lookup(pde_lookup)[pde_off]);
+    if(using_temp_map)
+        return get_direct_entry(get_pdpe_entry(address), address, PDT_SHIFT);
+
+    return &(pde_lookup[pde_off]);
 }
 
 static page_entry_t* get_pte_entry(void* address)
 {
     uint64_t pte_off = ((uintptr_t)address >> PTT_SHIFT) & PTE_MASK;
 
-    return &(get_lookup(pte_lookup)[pte_off]);
+    if(using_temp_map)
+        return get_direct_entry(get_pde_entry(address), address, PTT_SHIFT);
+
+    return &(pte_lookup[pte_off]);
+}
+
+static bool is_large_entry(page_entry_t* entry)
+{
+    // The page size bit of a PDE/PDPE is in the same place as the PTE PAT bit
+    return entry->pat;
+}
+
+/**
+ * Gets the entry that maps the address, which may be a PTE, or a PDE/PDPE
+ * when mapped by a large page. Returns NULL if an upper level is not present
+ */
+static page_entry_t* get_leaf_entry(void* address, size_t* page_size)
+{
+    page_entry_t* entry;
+
+    if(get_pml4e_entry(address)->p == 0)
+        return NULL;
+
+    entry = get_pdpe_entry(address);
+    if(entry->p == 0)
+        return NULL;
+
+    if(is_large_entry(entry))
+    {
+        *page_size = HUGE_PAGE_SIZE;
+        return entry;
+    }
+
+    entry = get_pde_entry(address);
+    if(entry->p == 0)
+        return NULL;
+
+    if(is_large_entry(entry))
+    {
+        *page_size = LARGE_PAGE_SIZE;
+        return entry;
+    }
+
+    *page_size = PAGE_SIZE;
+    return get_pte_entry(address);
 }
 
 // Returns true if a new structure was allocated, false otherwise.
@@ -165,6 +304,71 @@ static bool check_and_map_entry(page_entry_t* entry, void* address, uint32_t fla
     return false;
 }
 
+// Makes sure the table referenced by the entry exists, clearing it if it was just allocated
+static int map_table(page_entry_t* entry, page_entry_t* (*get_next_entry)(void*), void* address, uint32_t flags)
+{
+    if(check_and_map_entry(entry, address, flags | MMU_ACCESS_W))
+        memset((void*)((uintptr_t)get_next_entry(address) & ~PAGE_MASK), 0x00, 0x1000);
+    else if(entry->frame == KMEM_POISON || !entry->frame)
+        return MMU_MAPPING_ERROR;
+    else if(is_large_entry(entry))
+        return MMU_MAPPING_EXISTS;
+
+    return 0;
+}
+
+static int get_pat_index(uint32_t flags)
+{
+    switch(flags & MMU_CACHE_MASK)
+    {
+        case MMU_CACHE_WB:  return 0b000;
+        case MMU_CACHE_WT:  return 0b001;
+        case MMU_CACHE_UCO: return 0b010;
+        case MMU_CACHE_UC:  return 0b011;
+        case MMU_CACHE_WC:  return 0b100;
+        case MMU_CACHE_WP:  return 0b101;
+        default:
+            return MMU_MAPPING_NOT_CAPABLE;
+    }
+}
+
+static void set_entry_attr(page_entry_t* entry, void* address, uint32_t flags, uint8_t pat_index, bool large_page)
+{
+    entry->p =  (flags & MMU_ACCESS_R) >> 0;
+    entry->rw = (flags & MMU_ACCESS_W) >> 1;
+    entry->xd = ((~flags) & MMU_ACCESS_X) >> 2;
+    entry->su = (flags & MMU_ACCESS_USER) >> 3;
+    entry->g =  is_global_address(address);
+    entry->rsv = 0;
+
+    entry->pwt = (pat_index >> 0) & 1;
+    entry->pcd = (pat_index >> 1) & 1;
+
+    if(large_page)
+        entry->frame = (entry->frame & ~LARGE_PAT_BIT) | ((pat_index >> 2) & 1);
+    else
+        entry->pat = (pat_index >> 2) & 1;
+}
+
+// For user & execute access, change the levels above the page entry too
+static void set_upper_attr(void* address, uint32_t flags, size_t page_size)
+{
+    get_pml4e_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
+    get_pml4e_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
+
+    if(page_size < HUGE_PAGE_SIZE)
+    {
+        get_pdpe_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
+        get_pdpe_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
+    }
+
+    if(page_size < LARGE_PAGE_SIZE)
+    {
+        get_pde_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
+        get_pde_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
+    }
+}
+
 void pf_handler(struct intr_stack *frame, void* params)
 {
     struct PageError *page_error = (struct PageError*)&(frame->err_code);
@@ -181,7 +385,26 @@ void pf_handler(struct intr_stack *frame, void* params)
         }
     } else
     {
-        page_entry_t* entry = get_pte_entry((void*)address);
+        uint32_t access = MMU_ACCESS_R;
+        access |= page_error->was_write ? MMU_ACCESS_W : 0;
+        access |= page_error->was_instruction_fetch ? MMU_ACCESS_X : 0;
+        access |= page_error->was_user ? MMU_ACCESS_USER : 0;
+
+        // Fault in reserved pages on their first access, and copy shared pages on writes
+        if(vma_handle_fault((void*)address, access, page_error->was_present))
+            return;
+
+        page_entry_t dummy_entry;
+        size_t page_size;
+        page_entry_t* entry = get_leaf_entry((void*)address, &page_size);
+
+        if(entry == NULL)
+        {
+            memset(&dummy_entry, 0, sizeof(page_entry_t));
+            dummy_entry.xd = 1;
+            entry = &dummy_entry;
+        }
+
         kpanic_intr(frame, "Page fault at %p (error code PWUF: %d%d%d%d, PG PWUX: %d%d%d%d)", address,
                     page_error->was_present, page_error->was_write, page_error->was_user, page_error->was_instruction_fetch,
                     entry->p, entry->rw, entry->su, 1 - entry->xd);
@@ -210,42 +433,62 @@ void mmu_init()
     // 06  04  07  00  01  05  07  00
     uint64_t pat = 0x0007050100070406;
     msr_write(MSR_IA32_PAT, pat);
+
+    // Check for PCID & INVPCID support
+    uint32_t ecx = 0, ebx = 0;
+    asm volatile("cpuid":"=c"(ecx):"a"(1):"ebx","edx");
+    asm volatile("cpuid":"=b"(ebx):"a"(7),"c"(0):"edx");
+    has_pcid = (ecx >> 17) & 1;
+    has_invpcid = has_pcid && ((ebx >> 10) & 1);
+
+    initial_context.switch_base = cr3;
+    initial_context.asid = 0;
+    initial_context.tlb_stale = false;
+
+    if(has_pcid)
+        pcid_owners[0] = &initial_context;
+
+    // Global pages are also enabled in the bootstrap, but make sure of it
+    asm volatile("movq %%cr4, %%rax\n\t"
+                 "orq %%rdx, %%rax\n\t"
+                 "movq %%rax, %%cr4\n\t" :: "d"(CR4_PGE | (has_pcid ? CR4_PCIDE : 0)) : "rax");
+
+    // Check for 1GiB page support
+    uint32_t edx = 0;
+    asm volatile("cpuid":"=d"(edx):"a"(0x80000001):"ebx","ecx");
+    has_huge_pages = (edx >> 26) & 1;
 }
 
-int mmu_map(void* address, unsigned long mapping, uint32_t flags)
+// Makes sure all of the tables above the PTE exist
+static int map_tables(void* address, uint32_t flags)
 {
     int status = 0;
 
-    if(mapping == (uintptr_t)KNULL || address == KNULL)
-        return MMU_MAPPING_INVAL;
-
     // TODO: Add PML5 support
     // Check PML4E Presence
-    if(check_and_map_entry(get_pml4e_entry(address), address, flags | MMU_ACCESS_W))
-    {
-        uint64_t pdpe_base = ((uintptr_t)address >> PDPT_SHIFT) & (PDPE_MASK & ~0x1FF);
-        memset(&(get_lookup(pdpe_lookup)[pdpe_base]), 0x00, 0x1000);
-    }
-    else if(get_pml4e_entry(address)->frame == KMEM_POISON || !get_pml4e_entry(address)->frame)
-        return MMU_MAPPING_ERROR;
+    status = map_table(get_pml4e_entry(address), get_pdpe_entry, address, flags);
+    if(status != 0)
+        return status;
 
     // Check PDPE Presence
-    if(check_and_map_entry(get_pdpe_entry(address), address, flags | MMU_ACCESS_W))
-    {
-        uint64_t pde_base = ((uintptr_t)address >> PDT_SHIFT) & (PDE_MASK & ~0x1FF);
-        memset(&(get_lookup(pde_lookup)[pde_base]), 0x00, 0x1000);
-    }
-    else if(get_pdpe_entry(address)->frame == KMEM_POISON || !get_pml4e_entry(address)->frame)
-        return MMU_MAPPING_ERROR;
+    status = map_table(get_pdpe_entry(address), get_pde_entry, address, flags);
+    if(status != 0)
+        return status;
 
     // Check PDE Presence
-    if(check_and_map_entry(get_pde_entry(address), address, flags | MMU_ACCESS_W))
-    {
-        uint64_t pte_base = ((uintptr_t)address >> PTT_SHIFT) & (PTE_MASK & ~0x1FF);
-        memset(&(get_lookup(pte_lookup)[pte_base]), 0x00, 0x1000);
-    }
-    else if(get_pde_entry(address)->frame == KMEM_POISON || !get_pml4e_entry(address)->frame)
-        return MMU_MAPPING_ERROR;
+    return map_table(get_pde_entry(address), get_pte_entry, address, flags);
+}
+
+int mmu_map(void* address, unsigned long mapping, uint32_t flags)
+{
+    int status = 0;
+
+    if(mapping == (uintptr_t)KNULL || address == KNULL)
+        return MMU_MAPPING_INVAL;
+
+    status = map_tables(address, flags);
+    if(status != 0)
+        return status;
 
     // Check if we are trying to map to an already mapped address
     if(get_pte_entry(address)->p)
@@ -258,94 +501,348 @@ int mmu_map(void* address, unsigned long mapping, uint32_t flags)
     return status;
 }
 
-int mmu_change_attr(void* address, uint32_t flags)
+// Maps a 2MiB (PDE) or 1GiB (PDPE) page
+static int map_large(void* address, unsigned long mapping, uint32_t flags, size_t page_size)
 {
-    uint8_t pat_index = 0;
+    page_entry_t* entry;
+    int status = 0;
 
-    if( get_pml4e_entry(address)->p == 0 ||
-        get_pdpe_entry(address)->p == 0 ||
-        get_pde_entry(address)->p == 0)
-        return MMU_MAPPING_ERROR;
+    status = map_table(get_pml4e_entry(address), get_pdpe_entry, address, flags);
+    if(status != 0)
+        return status;
 
-    // For user & execute access, change the others too
-    get_pml4e_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
-    get_pdpe_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
-    get_pde_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
+    entry = get_pdpe_entry(address);
 
-    get_pml4e_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
-    get_pdpe_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
-    get_pde_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
+    if(page_size == LARGE_PAGE_SIZE)
+    {
+        status = map_table(entry, get_pde_entry, address, flags);
+        if(status != 0)
+            return status;
 
-    get_pte_entry(address)->p =  (flags & MMU_ACCESS_R) >> 0;
-    get_pte_entry(address)->rw = (flags & MMU_ACCESS_W) >> 1;
-    get_pte_entry(address)->xd = ((~flags) & MMU_ACCESS_X) >> 2;
-    get_pte_entry(address)->su = (flags & MMU_ACCESS_USER) >> 3;
-    get_pte_entry(address)->rsv = 0;
+        entry = get_pde_entry(address);
+    }
 
-    // Set up caching flags
-    switch(flags & MMU_CACHE_MASK)
+    // Don't replace an existing mapping or page table
+    if(entry->p || entry->frame != 0)
+        return MMU_MAPPING_EXISTS;
+
+    entry->frame = mapping >> 12;
+    entry->pat = 1; // Page size bit
+
+    set_upper_attr(address, flags, page_size);
+    set_entry_attr(entry, address, flags, get_pat_index(flags), true);
+
+    return 0;
+}
+
+// Maps the 4KiB pages up to the end of the page table that base is in
+static int map_small(uintptr_t* base, unsigned long* mapping, uintptr_t end, uint32_t flags)
+{
+    uintptr_t table_end = (*base | (LARGE_PAGE_SIZE - 1)) + 1;
+    page_entry_t* entry;
+    int status = 0;
+
+    status = map_tables((void*)*base, flags);
+    if(status != 0)
+        return status;
+
+    if(table_end > end || table_end == 0)
+        table_end = end;
+
+    set_upper_attr((void*)*base, flags, PAGE_SIZE);
+
+    // PTEs in the same table are next to each other in the lookup
+    for(entry = get_pte_entry((void*)*base); *base < table_end; *base += PAGE_SIZE, *mapping += PAGE_SIZE, entry++)
     {
-        case MMU_CACHE_WB:  pat_index = 0b000; break;
-        case MMU_CACHE_WT:  pat_index = 0b001; break;
-        case MMU_CACHE_UCO: pat_index = 0b010; break;
-        case MMU_CACHE_UC:  pat_index = 0b011; break;
-        case MMU_CACHE_WC:  pat_index = 0b100; break;
-        case MMU_CACHE_WP:  pat_index = 0b101; break;
-        default:
-            return MMU_MAPPING_NOT_CAPABLE;
+        if(entry->p)
+            return MMU_MAPPING_EXISTS;
+
+        entry->frame = *mapping >> 12;
+        set_entry_attr(entry, (void*)*base, flags, get_pat_index(flags), false);
     }
 
-    get_pte_entry(address)->pwt = (pat_index >> 0) & 1;
-    get_pte_entry(address)->pcd = (pat_index >> 1) & 1;
-    get_pte_entry(address)->pat = (pat_index >> 2) & 1;
+    return 0;
+}
+
+int mmu_map_range(void* address, unsigned long mapping, size_t size, uint32_t flags)
+{
+    static const size_t page_sizes[] = { HUGE_PAGE_SIZE, LARGE_PAGE_SIZE };
+
+    if(mapping == (uintptr_t)KNULL || address == KNULL)
+        return MMU_MAPPING_INVAL;
+
+    if(get_pat_index(flags) < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+    mapping &= ~PAGE_MASK;
+
+    // Entries only go from not present to present, so nothing needs to be flushed
+    while(base < end)
+    {
+        int status = MMU_MAPPING_EXISTS;
+
+        // Use the largest page that fits, falling back to smaller ones where page tables already exist
+        for(size_t i = 0; i < sizeof(page_sizes) / sizeof(page_sizes[0]) && status == MMU_MAPPING_EXISTS; i++)
+        {
+            size_t page_size = page_sizes[i];
+
+            if(page_size == HUGE_PAGE_SIZE && !has_huge_pages)
+                continue;
+            if(((base | mapping) & (page_size - 1)) != 0 || end - base < page_size)
+                continue;
+
+            status = map_large((void*)base, mapping, flags, page_size);
+
+            if(status == 0)
+            {
+                base += page_size;
+                mapping += page_size;
+            }
+        }
+
+        if(status == MMU_MAPPING_EXISTS)
+            status = map_small(&base, &mapping, end, flags);
+
+        if(status != 0)
+            return status;
+    }
+
+    return 0;
+}
+
+int mmu_change_attr(void* address, uint32_t flags)
+{
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+    int pat_index = get_pat_index(flags);
+
+    if(entry == NULL)
+        return MMU_MAPPING_ERROR;
+
+    set_upper_attr(address, flags, page_size);
+
+    if(pat_index < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    set_entry_attr(entry, address, flags, pat_index, page_size != PAGE_SIZE);
     invlpg(address);
 
     return 0;
 }
 
+int mmu_protect_range(void* address, size_t size, uint32_t flags)
+{
+    int pat_index = get_pat_index(flags);
+    int status = 0;
+
+    if(pat_index < 0)
+        return MMU_MAPPING_NOT_CAPABLE;
+
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    while(base < end)
+    {
+        size_t page_size = PAGE_SIZE;
+        page_entry_t* entry = get_leaf_entry((void*)base, &page_size);
+
+        // Tables are walked once for every group of entries
+        uintptr_t table_end = (base | (LARGE_PAGE_SIZE - 1)) + 1;
+        if(page_size == HUGE_PAGE_SIZE)
+            table_end = (base | (HUGE_PAGE_SIZE - 1)) + 1;
+        if(table_end > end || table_end == 0)
+            table_end = end;
+
+        if(entry == NULL)
+        {
+            status = MMU_MAPPING_ERROR;
+            base = table_end;
+            continue;
+        }
+
+        set_upper_attr((void*)base, flags, page_size);
+
+        if(page_size != PAGE_SIZE)
+        {
+            // The whole large page is changed
+            set_entry_attr(entry, (void*)base, flags, pat_index, true);
+            base = table_end;
+            continue;
+        }
+
+        for(; base < table_end; base += PAGE_SIZE, entry++)
+        {
+            // Leave holes in the range unmapped
+            if(entry->p)
+                set_entry_attr(entry, (void*)base, flags, pat_index, false);
+        }
+    }
+
+    flush_range((uintptr_t)address & ~PAGE_MASK, end);
+    return status;
+}
+
 bool mmu_unmap(void* address, bool erase)
 {
-    if( get_pml4e_entry(address)->p == 0 ||
-        get_pdpe_entry(address)->p == 0 ||
-        get_pde_entry(address)->p == 0) return false;
-    
-    get_pte_entry(address)->p = 0;
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+
+    if(entry == NULL)
+        return false;
+
+    if(page_size != PAGE_SIZE)
+    {
+        // Large pages are always erased, as a non-present entry with a frame is treated as a page table
+        memset(entry, 0, sizeof(page_entry_t));
+        invlpg(address);
+        return true;
+    }
+
+    entry->p = 0;
     if(erase)
     {
         mmu_change_attr(address, 0);
-        get_pte_entry(address)->frame = KMEM_POISON >> 12;
+        entry->frame = KMEM_POISON >> 12;
     }
     invlpg(address);
 
     return true;
 }
 
+void mmu_unmap_range(void* address, size_t size, bool erase)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    while(base < end)
+    {
+        size_t page_size = PAGE_SIZE;
+        page_entry_t* entry = get_leaf_entry((void*)base, &page_size);
+
+        // Tables are walked once for every group of entries
+        uintptr_t table_end = (base | (LARGE_PAGE_SIZE - 1)) + 1;
+        if(page_size == HUGE_PAGE_SIZE)
+            table_end = (base | (HUGE_PAGE_SIZE - 1)) + 1;
+        if(table_end > end || table_end == 0)
+            table_end = end;
+
+        if(entry != NULL && page_size != PAGE_SIZE)
+        {
+            // Large pages are always erased, as a non-present entry with a frame is treated as a page table
+            memset(entry, 0, sizeof(page_entry_t));
+        }
+        else if(entry != NULL)
+        {
+            for(uintptr_t page = base; page < table_end; page += PAGE_SIZE, entry++)
+            {
+                entry->p = 0;
+
+                if(erase)
+                {
+                    memset(entry, 0, sizeof(page_entry_t));
+                    entry->frame = KMEM_POISON >> 12;
+                }
+            }
+        }
+
+        base = table_end;
+    }
+
+    flush_range((uintptr_t)address & ~PAGE_MASK, end);
+}
+
 unsigned long mmu_get_mapping(void* address)
 {
-    if( get_pml4e_entry(address)->p == 0 ||
-        get_pdpe_entry(address)->p == 0 ||
-        get_pde_entry(address)->p == 0)
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+
+    if(entry == NULL)
         return 0;
 
-    return get_pte_entry(address)->frame << 12;
+    if(page_size == PAGE_SIZE)
+        return entry->frame << 12;
+
+    // Give the address of the 4KiB page inside of the large page
+    return ((entry->frame & ~LARGE_PAT_BIT) << 12) + ((uintptr_t)address & (page_size - 1) & ~PAGE_MASK);
 }
 
 bool mmu_check_access(void* address, uint32_t flags)
 {
-    if( get_pml4e_entry(address)->p == 0 ||
-        get_pdpe_entry(address)->p == 0 ||
-        get_pde_entry(address)->p == 0)
+    size_t page_size = PAGE_SIZE;
+    page_entry_t* entry = get_leaf_entry(address, &page_size);
+
+    if(entry == NULL)
         return false;
 
     uint32_t entry_flags = 0;
-    entry_flags |= (get_pte_entry(address)->p  << 0);
-    entry_flags |= (get_pte_entry(address)->rw << 1);
-    entry_flags |= (get_pte_entry(address)->xd << 2);
-    entry_flags |= (get_pte_entry(address)->su << 3);
+    entry_flags |= (entry->p  << 0);
+    entry_flags |= (entry->rw << 1);
+    entry_flags |= (entry->xd << 2);
+    entry_flags |= (entry->su << 3);
 
     return (entry_flags & flags) == flags;
 }
 
+void* mmu_next_mapped(void* address, void* end)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t skip;
+
+    while(base < (uintptr_t)end)
+    {
+        // Skip over whole tables that aren't present
+        if(get_pml4e_entry((void*)base)->p == 0)
+            skip = 1ULL << PML4_SHIFT;
+        else if(get_pdpe_entry((void*)base)->p == 0)
+            skip = HUGE_PAGE_SIZE;
+        else if(is_large_entry(get_pdpe_entry((void*)base)))
+            return (void*)base;
+        else if(get_pde_entry((void*)base)->p == 0)
+            skip = LARGE_PAGE_SIZE;
+        else if(is_large_entry(get_pde_entry((void*)base)) || get_pte_entry((void*)base)->p)
+            return (void*)base;
+        else
+            skip = PAGE_SIZE;
+
+        // Stop if the skip wraps around the address space
+        if(((base & ~(skip - 1)) + skip) <= base)
+            break;
+
+        base = (base & ~(skip - 1)) + skip;
+    }
+
+    return end;
+}
+
+void mmu_map_direct(unsigned long base, size_t length)
+{
+    if(base >= DIRECT_MAP_SIZE)
+        return;
+
+    if(length > DIRECT_MAP_SIZE - base)
+        length = DIRECT_MAP_SIZE - base;
+
+    // Large pages are picked wherever the range allows for them
+    if(mmu_map_range((void*)(DIRECT_MAP_BASE + base), base, length, MMU_ACCESS_RW | MMU_CACHE_WB) != 0)
+        kpanic("Unable to add %p - %p to the direct map", base, base + length);
+
+    has_direct_map = true;
+}
+
+void* mmu_phys_to_virt(unsigned long address)
+{
+    if(!has_direct_map || address >= DIRECT_MAP_SIZE)
+        return KNULL;
+
+    // Only usable memory and the kernel are in the direct map, not firmware areas
+    if(!mmu_check_access((void*)(DIRECT_MAP_BASE + address), MMU_ACCESS_R))
+        return KNULL;
+
+    return (void*)(DIRECT_MAP_BASE + address);
+}
+
 void* mm_get_base()
 {
     return (void*) MMU_BASE;
@@ -356,15 +853,14 @@ paging_context_t* mmu_create_context()
     // Create page context base
     unsigned long pml4_context = mm_alloc(1);
 
-    // Map context to temporary address
-    mmu_map((void*)temp_map_base, pml4_context, MMU_ACCESS_RW | MMU_CACHE_WB);
-    memset((void*)temp_map_base, 0x00, 0x1000);
+    // Access the context through the direct map
+    page_entry_t *pml4e_temp_lookup = mmu_phys_to_virt(pml4_context);
+    memset(pml4e_temp_lookup, 0x00, 0x1000);
 
     // Copy relavent mappings to address space (Excluding temporary and recursive mapping)
-    memcpy((uint8_t*)temp_map_base+2048, (uint8_t*)pml4e_lookup+2048, 2048-16);
+    memcpy((uint8_t*)pml4e_temp_lookup+2048, (uint8_t*)pml4e_lookup+2048, 2048-16);
 
     // Change recursive mapping entry
-    page_entry_t *pml4e_temp_lookup = (page_entry_t*)temp_map_base;
     pml4e_temp_lookup[511].frame = pml4_context >> 12ULL;
     pml4e_temp_lookup[511].xd = 0;
     pml4e_temp_lookup[511].rw = 1;
@@ -372,14 +868,63 @@ paging_context_t* mmu_create_context()
 
     paging_context_t *context = kmalloc(sizeof(paging_context_t));
     context->phybase = pml4_context;
+    context->switch_base = pml4_context;
+    context->asid = ASID_NONE;
+    context->tlb_stale = true;
 
-    mmu_unmap((void*)temp_map_base, true);
     return context;
 }
 
+/**
+ * Frees a table along with everything below it, including the mapped pages
+ * Level 0 is a page table, and level 2 is a page directory pointer table
+ */
+static void free_table(unsigned long table_frame, unsigned int level)
+{
+    page_entry_t* table = mmu_phys_to_virt(table_frame);
+
+    for(size_t i = 0; i < 512; i++)
+    {
+        page_entry_t* entry = &table[i];
+
+        if(!entry->p)
+            continue;
+
+        if(level == 0)
+            mm_free((unsigned long)entry->frame << 12, 1);
+        else if(!is_large_entry(entry))
+            free_table((unsigned long)entry->frame << 12, level - 1);
+        // Large pages only map device memory, which isn't owned by the context
+    }
+
+    mm_free(table_frame, 1);
+}
+
 void mmu_destroy_context(paging_context_t* context)
 {
     if(context == KNULL) return;
+
+    if(context == current_context || context == &initial_context)
+        kpanic("Tried to destroy an active address space");
+
+    if(context->asid < PCID_COUNT && pcid_owners[context->asid] == context)
+        pcid_owners[context->asid] = NULL;
+
+    // Only the user half is owned by the context, as the kernel half is shared
+    page_entry_t* pml4 = mmu_phys_to_virt(context->phybase);
+
+    for(size_t i = 0; i < 256; i++)
+    {
+        if(pml4[i].p)
+            free_table((unsigned long)pml4[i].frame << 12, 2);
+    }
+
+    if(temp_context == context)
+    {
+        temp_context = NULL;
+        using_temp_map = false;
+    }
+
     mm_free(context->phybase, 1);
     kfree(context);
 }
@@ -389,9 +934,46 @@ paging_context_t* mmu_current_context()
     return current_context;
 }
 
+// Gives the context a PCID, taking one away from another context if they are all in use
+static void assign_pcid(paging_context_t* context)
+{
+    uint16_t pcid = next_pcid;
+
+    for(size_t i = 0; i < PCID_COUNT - 1 && pcid_owners[pcid] != NULL; i++)
+        pcid = (pcid % (PCID_COUNT - 1)) + 1;
+
+    // The previous owner will get a new PCID when it is switched to next
+    next_pcid = (pcid % (PCID_COUNT - 1)) + 1;
+    pcid_owners[pcid] = context;
+    context->asid = pcid;
+
+    // Entries from the previous owner can't be left behind
+    if(has_invpcid)
+        invpcid(1, pcid, NULL);
+    else
+        context->tlb_stale = true;
+}
+
 void mmu_set_context(paging_context_t* addr_context)
 {
     current_context = addr_context;
+
+    if(!has_pcid)
+        return;
+
+    bool flush = false;
+
+    if(addr_context->asid >= PCID_COUNT || pcid_owners[addr_context->asid] != addr_context)
+        assign_pcid(addr_context);
+
+    // The PCID may still have stale entries (kernel mappings are global, so they are never stale)
+    if(addr_context->tlb_stale)
+    {
+        flush = true;
+        addr_context->tlb_stale = false;
+    }
+
+    addr_context->switch_base = addr_context->phybase | addr_context->asid | (flush ? 0 : CR3_NO_FLUSH);
 }
 
 void mmu_set_temp_context(paging_context_t* addr_context)
@@ -403,16 +985,14 @@ void mmu_set_temp_context(paging_context_t* addr_context)
         return;
     }
 
-    if(temp_context != addr_context)
-    {
-        // Change the context to the new one
-        temp_context = addr_context;
+    // The temp context's tables are walked through the direct map
+    if(!has_direct_map)
+        kpanic("Tried to use a temp context before the direct map was built");
 
-        // Overwrite the temporary mapping entry
-        pml4e_lookup[510].frame = temp_context->phybase >> 12ULL;
-        invlpg(&(pml4e_lookup[510]));
-    }
+    // Mappings changed through the temp context aren't flushed from the context's PCID
+    addr_context->tlb_stale = true;
 
+    temp_context = addr_context;
     using_temp_map = true;
 }
 
@@ -425,7 +1005,7 @@ void mmu_switch_context(paging_context_t* addr_context)
 {
     // If we're switching to the same address context, then don't bother
     if(addr_context == current_context) return;
-    current_context = addr_context;
+    mmu_set_context(addr_context);
     asm volatile("movq %%rax, %%cr3\n\t"::
-        "a"(addr_context->phybase));
+        "a"(addr_context->switch_base));
 }
@@ -24,24 +24,10 @@
 #include <common/mm/mm.h>
 #include <common/sched/sched.h>
 #include <common/tasks/tasks.h>
+#include <common/util/kfuncs.h>
 
 extern void __initialize_thread();
 
-/****SUPER TEMPORARY ADDRESS ALLOCATION****/
-// #ifndef __K4_VISUAL_STACK__
-static uint64_t alloc_base = 0xFFFF900000000000;
-// #else
-// static uint64_t alloc_base = 0xFFFFE00000080000;
-// #endif
-
-uint64_t alloc_address()
-{
-    alloc_base -= 0x1000; // 4KiB guard page
-    uint64_t retval = alloc_base;
-    alloc_base -= THREAD_STACK_SIZE;
-    return retval;
-}
-
 /**
  * Initializes the architecture-specfic side of a thread
  */
@@ -54,14 +40,9 @@ void init_register_state(thread_t *thread, uint64_t *entry_point, unsigned long*
     }
     else
     {
-        // Allocate a new stack
-        uint64_t stack = alloc_address();
-        thread->kernel_sp = stack;
-        thread->kernel_stacktop = stack;
-
-        // Map stack pages
-        for(int i = 0; i < (THREAD_STACK_SIZE >> 12); i++)
-            mmu_map((void*)(thread->kernel_stacktop - (i << 12)), mm_alloc(1), MMU_FLAGS_DEFAULT);
+        // Reuse a stack from an exited thread, if there is one
+        thread->kernel_stacktop = kstack_alloc();
+        thread->kernel_sp = thread->kernel_stacktop;
     }
 
     volatile uint64_t * thread_stack = (uint64_t*)thread->kernel_sp;
@@ -91,5 +72,5 @@ void init_register_state(thread_t *thread, uint64_t *entry_point, unsigned long*
 
 void cleanup_register_state(thread_t *thread)
 {
-    
+    kstack_free(thread->kernel_stacktop);
 }
@@ -1,6 +1,7 @@
 
 #include <common/acpi.h>
 #include <common/mm/liballoc.h>
+#include <common/mm/mm.h>
 #include <common/util/klog.h>
 #include <common/util/kfuncs.h>
 
@@ -17,7 +18,16 @@ struct ECDT_CONTEXT
     uint8_t GpeBit;
 };
 
+struct table_range
+{
+    ACPI_PHYSICAL_ADDRESS base;
+    ACPI_PHYSICAL_ADDRESS limit;
+};
+
 static ACPI_TABLE_DESC early_tables[ACPI_MAX_EARLY_TABLES];
+// Tables which are still used in place by ACPICA
+static struct table_range table_ranges[ACPI_MAX_TABLES];
+static size_t num_table_ranges = 0;
 
 static bool acpi_initalized = false;
 static struct ECDT_CONTEXT ec_context = {};
@@ -316,6 +326,58 @@ ACPI_STATUS acpi_init()
     return status;
 }
 
+static bool acpi_table_in_frame(unsigned long frame)
+{
+    for(size_t i = 0; i < num_table_ranges; i++)
+    {
+        if(frame < table_ranges[i].limit && frame + PAGE_SIZE > table_ranges[i].base)
+            return true;
+    }
+
+    return false;
+}
+
+void acpi_reclaim_memory()
+{
+    if(!acpi_initalized)
+        return;
+
+    // The AML in the tables is still executed from where the firmware put
+    // them, so keep every frame which has a table in it
+    num_table_ranges = 0;
+
+    for(uint32_t i = 0; i < ACPI_MAX_TABLES; i++)
+    {
+        ACPI_TABLE_HEADER* table = NULL;
+        ACPI_PHYSICAL_ADDRESS base;
+
+        if(ACPI_FAILURE(AcpiGetTableByIndex(i, &table)) || table == NULL)
+            break;
+
+        if(ACPI_SUCCESS(AcpiOsGetPhysicalAddress(table, &base)))
+        {
+            if(num_table_ranges >= ACPI_MAX_TABLES)
+            {
+                AcpiPutTable(table);
+                klog_logln(LVL_WARN, "Too many ACPI tables, not reclaiming memory");
+                return;
+            }
+
+            // Only the frame is given back, so add the table's offset into it
+            base |= (uintptr_t)table & PAGE_MASK;
+
+            table_ranges[num_table_ranges].base = base;
+            table_ranges[num_table_ranges].limit = base + table->Length;
+            num_table_ranges++;
+        }
+
+        AcpiPutTable(table);
+    }
+
+    size_t released = mm_reclaim(acpi_table_in_frame);
+    klog_logln(LVL_INFO, "Reclaimed %luKiB of ACPI memory (%lu tables kept)", (unsigned long)(released << 2), (unsigned long)num_table_ranges);
+}
+
 ACPI_TABLE_HEADER* acpi_early_get_table(char* sig, uint32_t instance)
 {
     ACPI_TABLE_HEADER* table = NULL;
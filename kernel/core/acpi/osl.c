@@ -6,6 +6,7 @@
 #include <common/io/pci.h>
 #include <common/mm/mm.h>
 #include <common/mm/liballoc.h>
+#include <common/mm/vmem.h>
 #include <common/sched/sched.h>
 #include <common/tasks/tasks.h>
 #include <common/util/kfuncs.h>
@@ -26,23 +27,8 @@ struct acpi_handler
 static struct acpi_handler* handler_head = KNULL;
 static process_t* acpid_process = KNULL;
 
-static uintptr_t mapping_base = MMIO_MAP_BASE + 0x1000; // Add a page to skip over MMIO temporary mapping
 static uint8_t*  mmio_mapping = (uint8_t*)MMIO_MAP_BASE;
 
-/**
- * @brief  Reserves a section of memory to be mapped
- * @note   
- * @param  bytes: The number of bytes to map
- * @retval The base of the allocation
- */
-static size_t page_alloc(size_t bytes)
-{
-    size_t page_bytes = (bytes + 0xFFF) & ~0xFFF;
-    size_t base = mapping_base;
-    mapping_base += page_bytes;
-    return base;
-}
-
 static irq_ret_t acpi_handler_wrapper(struct irq_handler* handler)
 {
     struct acpi_handler* node = handler_head;
@@ -102,21 +88,16 @@ ACPI_STATUS AcpiOsPhysicalTableOverride(ACPI_TABLE_HEADER *ExistingTable, ACPI_P
 
 void *AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS PhysicalAddress, ACPI_SIZE Length)
 {
-    // TODO: Replace with actual memory management allocation
-    // Watermark allocate the pages
-    size_t num_pages = ((PhysicalAddress & 0xFFF) + Length + 0xFFF) & ~0xFFF;
-    size_t dynamic_base = page_alloc(num_pages);
-
-    for(size_t off = 0; off < num_pages; off += 0x1000)
-        mmu_map((void*)dynamic_base + off, (PhysicalAddress & ~0xFFF) + off, MMU_FLAGS_DEFAULT);
+    void* mapping = ioremap(PhysicalAddress, Length, MMU_FLAGS_DEFAULT);
 
-    return (void*)(dynamic_base + ((size_t)PhysicalAddress & 0xFFF));
+    if(mapping == KNULL)
+        return NULL;
+    return mapping;
 }
 
 void AcpiOsUnmapMemory(void *where, ACPI_SIZE length)
 {
-    // TODO: Unmap allocated dynamic memory
-    // Will not unmap memory for now...
+    iounmap(where, length);
 }
 
 ACPI_STATUS AcpiOsGetPhysicalAddress(void *LogicalAddress, ACPI_PHYSICAL_ADDRESS *PhysicalAddress)
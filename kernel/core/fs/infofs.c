@@ -0,0 +1,140 @@
+#include <common/fs/infofs.h>
+
+#include <string.h>
+
+#include <common/mm/liballoc.h>
+#include <common/util/klog.h>
+
+// Largest file that can be generated
+#define INFOFS_BUFFER_SIZE 16384
+
+extern struct dirent* default_dnode_readdir(struct dnode *dnode, size_t index, struct dirent* dirent);
+extern struct dnode* default_dnode_finddir(struct dnode *dnode, const char* path);
+
+static struct dnode_ops infofs_dops =
+{
+    .read_dir = default_dnode_readdir,
+    .find_dir = default_dnode_finddir,
+};
+
+static void construct_dnode(struct fs_instance* instance, struct dnode *dnode, struct inode *inode, const char* path)
+{
+    dnode->instance = instance;
+    dnode->inode = inode;
+    dnode->path = path;
+    dnode->name = strrchr(path, '/');
+    if(dnode->name == NULL)
+        dnode->name = path;
+    dnode->parent = NULL;
+    dnode->subdirs = NULL;
+    dnode->next = NULL;
+
+    dnode->dops = &infofs_dops;
+}
+
+extern void default_open(struct inode *file_node, int oflags);
+extern void default_close(struct inode *file_node);
+
+// Reads bytes from the node, generating the contents on every read
+static ssize_t infofs_read(struct inode *file_node, size_t off, size_t len, void* buffer)
+{
+    if((file_node->type & 7) == VFS_TYPE_DIRECTORY)
+        return 0;   // No reading for u.
+
+    struct infofs_inode* info_node = (struct infofs_inode*)file_node;
+    char* contents = kmalloc(INFOFS_BUFFER_SIZE);
+
+    if(contents == NULL)
+        return -1;
+
+    size_t size = info_node->generate(contents, INFOFS_BUFFER_SIZE);
+
+    if(off >= size)
+    {
+        kfree(contents);
+        return 0;
+    }
+
+    if(len > size - off)
+        len = size - off;
+
+    memcpy(buffer, contents + off, len);
+    kfree(contents);
+
+    return len;
+}
+
+static ssize_t infofs_write(struct inode *file_node, size_t off, size_t len, void* buffer)
+{
+    return 0;   // Everything is read-only
+}
+
+static struct inode_ops infofs_iops =
+{
+    .open = default_open,
+    .close = default_close,
+    .read = infofs_read,
+    .write = infofs_write,
+};
+
+static void construct_inode(struct infofs_instance *instance, struct inode *inode)
+{
+    inode->instance = (struct fs_instance*)instance;
+    inode->num_users = 0;
+    inode->num_users_lock = mutex_create();
+    inode->iops = &infofs_iops;
+    inode->perms_mask = 0444;
+    inode->size = 0;
+    inode->symlink_ptr = NULL;
+    inode->gid = 0;
+    inode->uid = 0;
+
+    inode->fs_inode = instance->next_inode++;
+}
+
+struct fs_instance* infofs_create()
+{
+    struct infofs_instance *instance = kmalloc(sizeof(struct infofs_instance));
+    struct dnode *root_dir = kmem_cache_alloc(&dnode_cache);
+    struct inode *root_inode = kmem_cache_alloc(&inode_cache);
+
+    instance->dnodes = NULL;
+    instance->next_inode = 0;
+
+    construct_dnode((struct fs_instance*)instance, root_dir, root_inode, "/");
+    construct_inode(instance, root_inode);
+
+    root_inode->type = VFS_TYPE_DIRECTORY;
+
+    instance->instance.root = root_dir;
+
+    return (struct fs_instance*)instance;
+}
+
+void infofs_add_file(struct infofs_instance* instance, infofs_generate_t generate, const char* path)
+{
+    // All files live in the root
+    struct dnode *parent_dir = instance->instance.root;
+
+    struct infofs_dnode *dnode = kmalloc(sizeof(struct infofs_dnode));
+    struct infofs_inode *inode = kmalloc(sizeof(struct infofs_inode));
+
+    construct_inode(instance, (struct inode*)inode);
+    construct_dnode((struct fs_instance*)instance, (struct dnode*)dnode, (struct inode*)inode, path);
+
+    inode->inode.type = VFS_TYPE_FILE;
+    inode->generate = generate;
+
+    // Append to dnode list
+    dnode->next = instance->dnodes;
+    instance->dnodes = dnode;
+
+    // Append it to the parent dir
+    dnode->dnode.next = parent_dir->subdirs;
+    parent_dir->subdirs = (struct dnode*)dnode;
+}
+
+void infofs_destroy(struct fs_instance* instance)
+{
+    //kfree(instance);
+}
@@ -196,7 +196,7 @@ static void append_dirent(struct inode* target, char* base_path, const char* fil
     }
 
     // Setup current dirent
-    struct dnode* dnode = kmalloc(sizeof(struct dnode));
+    struct dnode* dnode = kmem_cache_alloc(&dnode_cache);
     construct_dir_node(dnode, target, filename, path);
 
     // Pass the fs_instance down
@@ -217,8 +217,8 @@ struct fs_instance* tarfs_init(void* address, size_t tar_len)
 
     // Setup root node
     struct fs_instance* instance = kmalloc(sizeof(struct fs_instance));
-    root_node = kmalloc(sizeof(struct inode));
-    root_dir = kmalloc(sizeof(struct dnode));
+    root_node = kmem_cache_alloc(&inode_cache);
+    root_dir = kmem_cache_alloc(&dnode_cache);
 
     construct_node(instance, root_node);
     root_node->type = VFS_TYPE_DIRECTORY;
@@ -240,7 +240,7 @@ struct fs_instance* tarfs_init(void* address, size_t tar_len)
     {
         unsigned int size = getsize(tar_file->size);
         const char* filename = strrchr(tar_file->filename, '/');
-        struct inode* node = kmalloc(sizeof(struct inode));
+        struct inode* node = kmem_cache_alloc(&inode_cache);
 
         // Setup vfs_node
         node_list[finode - NODE_LIST_BASE] = node;
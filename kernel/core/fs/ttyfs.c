@@ -83,8 +83,8 @@ static void construct_inode(struct ttyfs_instance *instance, struct inode *inode
 struct fs_instance* ttyfs_create()
 {
     struct ttyfs_instance *instance = kmalloc(sizeof(struct ttyfs_instance));
-    struct dnode *root_dir = kmalloc(sizeof(struct dnode));
-    struct inode *root_inode = kmalloc(sizeof(struct inode));
+    struct dnode *root_dir = kmem_cache_alloc(&dnode_cache);
+    struct inode *root_inode = kmem_cache_alloc(&inode_cache);
 
     construct_dnode(instance, root_dir, root_inode, "/");
     construct_inode(instance, root_inode);
@@ -26,6 +26,9 @@
 #include <common/mm/liballoc.h>
 #include <common/util/klog.h>
 
+kmem_cache_t inode_cache = KMEM_CACHE_INIT("inode", sizeof(struct inode), 0, NULL);
+kmem_cache_t dnode_cache = KMEM_CACHE_INIT("dnode", sizeof(struct dnode), 0, NULL);
+
 static struct inode *root_node = KNULL;
 static const char *root_path = KNULL;
 static unsigned int num_mounts;
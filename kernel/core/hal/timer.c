@@ -1,6 +1,6 @@
 #include <common/hal/timer.h>
 #include <common/util/klog.h>
-#include <common/mm/liballoc.h>
+#include <common/mm/slab.h>
 
 #define MAX_TIMERS 64
 
@@ -9,6 +9,7 @@ static uint64_t timer_id_bitmap = ~1;
 // Default timer (index to array below)
 static unsigned int default_timer = ~0x0;
 static struct timer_dev* timers[MAX_TIMERS];
+static kmem_cache_t handler_node_cache = KMEM_CACHE_INIT("timer_handler_node", sizeof(struct timer_handler_node), 0, NULL);
 
 // Valid timer id's are in the range of 1 - 64
 static unsigned int next_timer_id()
@@ -69,7 +70,7 @@ void timer_add_handler(unsigned long id, timer_handler_t handler_function)
     if(timers[timer_id] == KNULL || timers[timer_id] == NULL)
         return;
 
-    struct timer_handler_node* node = kmalloc(sizeof(struct timer_handler_node));
+    struct timer_handler_node* node = kmem_cache_alloc(&handler_node_cache);
     klog_logln(LVL_INFO, "Timer handler add: %p (%d -> %p)", handler_function, id, timers[timer_id]);
     klog_logln(LVL_INFO, "Timer handler node: %p", node);
     if(node == NULL)
@@ -98,7 +99,7 @@ void timer_add_handler(unsigned long id, timer_handler_t handler_function)
 
     if(current_node == KNULL)
     {
-        kfree(node);
+        kmem_cache_free(&handler_node_cache, node);
         return;
     }
 
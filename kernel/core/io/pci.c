@@ -2,10 +2,11 @@
 #include <string.h>
 
 #include <common/io/pci.h>
-#include <common/mm/liballoc.h>
+#include <common/mm/slab.h>
 #include <common/util/kfuncs.h>
 
 struct pci_dev_handler* driver_head = KNULL;
+static kmem_cache_t pci_dev_cache = KMEM_CACHE_INIT("pci_dev", sizeof(struct pci_dev), 0, NULL);
 
 void test_function(uint8_t bus, uint8_t device, uint8_t function)
 {
@@ -132,7 +133,7 @@ void pci_handle_dev(struct pci_dev_handler *handle)
 
 struct pci_dev* pci_get_dev(uint8_t bus, uint8_t device, uint8_t function)
 {
-    struct pci_dev* dev = kmalloc(sizeof(struct pci_dev));
+    struct pci_dev* dev = kmem_cache_alloc(&pci_dev_cache);
 
     if(dev == NULL)
         return KNULL;
@@ -165,7 +166,7 @@ struct pci_dev* pci_get_dev(uint8_t bus, uint8_t device, uint8_t function)
 void pci_put_dev(struct pci_dev* dev)
 {
     pci_free_irq(dev);
-    kfree(dev);
+    kmem_cache_free(&pci_dev_cache, dev);
 }
 
 int pci_alloc_irq(struct pci_dev* dev, uint8_t num_irqs, uint32_t flags)
@@ -1,7 +1,9 @@
 #include <common/ipc/message.h>
-#include <common/mm/liballoc.h>
+#include <common/mm/slab.h>
 #include <common/sched/sched.h>
 
+static kmem_cache_t msg_cache = KMEM_CACHE_INIT("ipc_message", sizeof(struct ipc_message), 0, NULL);
+
 static void msg_enqueue(struct ipc_message_queue* queue, struct ipc_message* msg)
 {
     // Queue is full, don't do it
@@ -140,7 +142,7 @@ int msg_recv(uint32_t expected_type, struct ipc_message** dest, uint32_t flags,
             return status;
 
         // Construct & send ACK
-        struct ipc_message* ack = kmalloc(sizeof(struct ipc_message));
+        struct ipc_message* ack = kmem_cache_alloc(&msg_cache);
 
         build_msg(ack, MSG_TYPE_ACK, NULL, 0);
         status = msg_send_async(tmp->src, ack, 0, 0);
@@ -38,11 +38,13 @@
 #include <common/kshell/kshell.h>
 #include <common/mm/liballoc.h>
 #include <common/mm/mm.h>
+#include <common/mm/slab.h>
 #include <common/sched/sched.h>
 #include <common/tasks/tasks.h>
 #include <common/fs/vfs.h>
 #include <common/fs/tarfs.h>
 #include <common/fs/ttyfs.h>
+#include <common/fs/infofs.h>
 #include <common/tty/fb.h>
 #include <common/tty/tty.h>
 #include <common/usb/usb.h>
@@ -54,14 +56,18 @@
 extern uint32_t initrd_start;
 extern uint32_t initrd_size;
 extern unsigned long long tswp_counter;
-extern struct thread_queue run_queue;
+extern struct thread_queue run_queues[PRIORITY_COUNT];
 
 void core_fini();
 
 void idle_loop()
 {
     while(1)
-        intr_wait();
+    {
+        // Do some zeroing while there's nothing else to do
+        if(!mm_zero_pool_refill())
+            intr_wait();
+    }
 }
 
 void info_display()
@@ -115,20 +121,23 @@ void info_display()
         sprintf(buf, "[%s] ", sched_active_thread()->name);
         tty_puts(tty, buf);
 
-        // Thread queue proper
-        thread_t* node = run_queue.queue_head;
-        while(node != KNULL)
+        // Thread queues proper, from the highest priority down
+        for(int priority = PRIORITY_COUNT - 1; priority >= 0 && current_thread_count <= 8; priority--)
         {
-            if(current_thread_count > 8)
+            thread_t* node = run_queues[priority].queue_head;
+            while(node != KNULL)
             {
-                tty_puts(tty, "...");
-                break;
+                if(current_thread_count > 8)
+                {
+                    tty_puts(tty, "...");
+                    break;
+                }
+
+                sprintf(buf, "%s ", node->name);
+                tty_puts(tty, buf);
+                node = node->next;
+                current_thread_count++;
             }
-
-            sprintf(buf, "%s ", node->name);
-            tty_puts(tty, buf);
-            node = node->next;
-            current_thread_count++;
         }
         tty_putchar(tty, '\n');
 
@@ -175,18 +184,13 @@ void main_fb_init()
     // Map framebuffer (and any extra bits of it)
     unsigned long fb_size = (fb_info.width * fb_info.height * fb_info.bytes_pp + 0xFFF) & ~0xFFF;
 
-    int status = 0;
+    int status = mmu_map_range(framebuffer, fb_info.base_addr, fb_size + 0x1000, MMU_ACCESS_RW | MMU_CACHE_WC);
 
-    for(unsigned long off = 0; off <= fb_size; off += 0x1000)
+    // Retry using WB caching if mapping failed, removing whatever was already mapped
+    if(status == MMU_MAPPING_NOT_CAPABLE)
     {
-        status = mmu_map(framebuffer + off, fb_info.base_addr + off, MMU_ACCESS_RW | MMU_CACHE_WC);
-
-        // Retry using WB caching if mapping failed
-        if(status != 0 && status == MMU_MAPPING_NOT_CAPABLE)
-            status = mmu_map(framebuffer + off, fb_info.base_addr + off, MMU_ACCESS_RW | MMU_CACHE_WB);
-
-        if(status != 0)
-            break;
+        mmu_unmap_range(framebuffer, fb_size + 0x1000, false);
+        status = mmu_map_range(framebuffer, fb_info.base_addr, fb_size + 0x1000, MMU_ACCESS_RW | MMU_CACHE_WB);
     }
 
     if(status != 0 || !mmu_check_access(get_fb_address(), MMU_ACCESS_RW))
@@ -251,6 +255,16 @@ void kmain()
     }
 }
 
+static size_t meminfo_generate(char* buffer, size_t length)
+{
+    return mm_format_info(buffer, length, true);
+}
+
+static size_t slabinfo_generate(char* buffer, size_t length)
+{
+    return kmem_format_info(buffer, length);
+}
+
 void walk_dir(struct dnode* dir, int level)
 {
     struct dirent dirent;
@@ -287,6 +301,8 @@ void core_fini()
     syscall_init();
 
     acpi_init();
+    acpi_reclaim_memory();
+    mm_info_init();
 
     kbd_init();
     // usb_init();
@@ -335,8 +351,11 @@ void core_fini()
         klog_logln(LVL_INFO, "Setting up initrd");
         
         // Map initrd to temporary region
-        for(size_t off = 0; off < PAGE_ROUNDUP(initrd_size) && off < INITRD_SIZE; off += PAGE_SIZE)
-            mmu_map((void*)(INITRD_BASE + off), initrd_start + off, MMU_FLAGS_DEFAULT);
+        size_t map_size = PAGE_ROUNDUP(initrd_size);
+        if(map_size > INITRD_SIZE)
+            map_size = INITRD_SIZE;
+
+        mmu_map_range((void*)INITRD_BASE, initrd_start, map_size, MMU_FLAGS_DEFAULT);
 
         struct fs_instance* tarfs = tarfs_init((void*)INITRD_BASE, initrd_size);
         klog_logln(LVL_INFO, "Mounting initrd:");
@@ -347,6 +366,12 @@ void core_fini()
         struct fs_instance* ttyfs = ttyfs_create();
         vfs_mount(ttyfs, "/dev");
 
+        klog_logln(LVL_INFO, "Mounting infofs:");
+        struct fs_instance* infofs = infofs_create();
+        infofs_add_file((struct infofs_instance*)infofs, meminfo_generate, "meminfo");
+        infofs_add_file((struct infofs_instance*)infofs, slabinfo_generate, "slabinfo");
+        vfs_mount(infofs, "/proc");
+
         klog_logln(LVL_INFO, "Walking dir tree:");
         walk_dir(root->instance->root, 0);
     }
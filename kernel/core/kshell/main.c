@@ -29,7 +29,10 @@
 #include <common/io/kbd.h>
 #include <common/kshell/kshell.h>
 #include <common/mm/mm.h>
+#include <common/mm/heapprof.h>
 #include <common/mm/liballoc.h>
+#include <common/mm/slab.h>
+#include <common/mm/vma.h>
 #include <common/tty/tty.h>
 #include <common/tty/fb.h>
 #include <common/sched/sched.h>
@@ -37,6 +40,7 @@
 
 #include <common/hal.h>
 #include <common/util/kfuncs.h>
+#include <common/util/ksym.h>
 #include <common/io/uart.h>
 #include <common/fs/ttyfs.h>
 
@@ -56,6 +60,7 @@
 #define SHELL_HEIGHT 25
 #define SHELL_SCREEN_SIZE (SHELL_WIDTH * SHELL_HEIGHT)
 #define SHELL_SCREENS 64
+#define MEMINFO_SIZE 16384
 
 static char* input_buffer = KNULL;
 static int index = 0;
@@ -116,21 +121,21 @@ void program_launch(const char* path)
         // Flip flag around (RWX -> XWR) and add read flag by default
         flags = ((flags & PF_X) << 2) | (flags & PF_W) | MMU_ACCESS_R;
 
-        for(size_t off = 0; off < PAGE_ROUNDUP(proghead->p_memsz); off += 0x1000)
+        // Initially reserve pages as RW, so that the file data can be copied in
+        // Pages are zeroed when first touched, so the bss is clear & costs nothing until used
+        if(vma_reserve(sched_active_process(), (void*)proghead->p_vaddr, proghead->p_memsz, MMU_FLAGS_DEFAULT | MMU_ACCESS_USER) != 0)
         {
-            // Initially map pages to RW
-            mmu_map((void*)((proghead->p_vaddr + off) & ~PAGE_MASK), mm_alloc(1), MMU_FLAGS_DEFAULT | MMU_ACCESS_USER);
+            klog_logln(LVL_ERROR, "Error: Segment at %p overlaps another segment", proghead->p_vaddr);
+            elf_put(elf_data);
+            sched_terminate();
         }
 
         // Copy data from the file
         vfs_read(elf_data->file, proghead->p_offset, proghead->p_filesz, (void*)proghead->p_vaddr);
 
-        for(size_t off = 0; off < PAGE_ROUNDUP(proghead->p_memsz); off += 0x1000)
-        {
-            // Set as the final type
-            mmu_change_attr((void*)(proghead->p_vaddr + off), flags | MMU_ACCESS_USER | MMU_CACHE_WB);
-            klog_logln(LVL_DEBUG, "FlgsSet: %x", flags | MMU_ACCESS_USER | MMU_CACHE_WB);
-        }
+        // Set as the final type
+        vma_protect(sched_active_process(), (void*)proghead->p_vaddr, proghead->p_memsz, flags | MMU_ACCESS_USER | MMU_CACHE_WB);
+        klog_logln(LVL_DEBUG, "FlgsSet: %x", flags | MMU_ACCESS_USER | MMU_CACHE_WB);
     }
 
     // Last cleanup
@@ -362,6 +367,10 @@ static bool shell_parse()
         puts("\tshutdown [exit]: \tShuts down the computer");
         puts("\treboot:          \tReboots the computer");
         puts("\tps:              \tPrints out a list of all processes and threads");
+        puts("\tmeminfo [regions]:\tShows the physical memory statistics, and");
+        puts("\t                 \toptionally the statistics of every region");
+        puts("\tslabinfo:        \tShows the statistics of every object cache");
+        puts("\theapprof:        \tShows the heap allocations by call site");
         return true;
     } else if(is_command("fonttest", command))
     {
@@ -472,6 +481,58 @@ static bool shell_parse()
         print_tree(&init_process, 0);
         return true;
     }
+    else if(is_command("meminfo", command))
+    {
+        char* option = strtok_r(NULL, ARG_DELIM, &saveptr);
+        bool show_regions = option != NULL && strnicmp(option, "regions", 7) == 0;
+        char* info = kmalloc(MEMINFO_SIZE);
+        char* info_saveptr;
+
+        if(info == NULL)
+            return true;
+
+        mm_format_info(info, MEMINFO_SIZE, show_regions);
+
+        for(char* line = strtok_r(info, "\n", &info_saveptr); line != NULL; line = strtok_r(NULL, "\n", &info_saveptr))
+            puts(line);
+
+        kfree(info);
+        return true;
+    }
+    else if(is_command("slabinfo", command))
+    {
+        char* info = kmalloc(MEMINFO_SIZE);
+        char* info_saveptr;
+
+        if(info == NULL)
+            return true;
+
+        kmem_format_info(info, MEMINFO_SIZE);
+
+        for(char* line = strtok_r(info, "\n", &info_saveptr); line != NULL; line = strtok_r(NULL, "\n", &info_saveptr))
+            puts(line);
+
+        kfree(info);
+        return true;
+    }
+    else if(is_command("heapprof", command))
+    {
+        char* info = kmalloc(MEMINFO_SIZE);
+        char* info_saveptr;
+
+        if(info == NULL)
+            return true;
+
+        // Sites are shown as addresses if there isn't a symbol table
+        ksym_load(KSYM_FILE);
+        heapprof_format_info(info, MEMINFO_SIZE);
+
+        for(char* line = strtok_r(info, "\n", &info_saveptr); line != NULL; line = strtok_r(NULL, "\n", &info_saveptr))
+            puts(line);
+
+        kfree(info);
+        return true;
+    }
 
     // Try loading a program
     struct vfs_mount* mount = vfs_get_mount("/");
@@ -22,57 +22,70 @@
 #include <common/util/kfuncs.h>
 #include <common/mm/liballoc.h>
 #include <common/mm/mm.h>
+#include <common/mm/vmem.h>
 #include <common/tty/tty.h>
 
-static size_t heap_base = 0;
-static size_t heap_limit = 0;
-static size_t free_base = 0;
+static vmem_t heap_arena;
 static cpu_flags_t flags = 0;
 
+#define MAGAZINE_CLASSES    6   // Size classes, from 16 to 512 bytes
+#define MAGAZINE_MIN_SHIFT  4
+#define MAGAZINE_ROUNDS     32  // Allocations held for each size class
+
+/**
+ * Recently freed small allocations, ready to be handed out again without
+ * taking the liballoc lock
+ */
+struct cpu_magazines
+{
+    uint32_t busy;      // Set while the magazines are being changed
+    struct
+    {
+        size_t count;
+        void* rounds[MAGAZINE_ROUNDS];
+    } classes[MAGAZINE_CLASSES];
+};
+
+// Only the boot CPU is brought up, so it is the only one with magazines
+static struct cpu_magazines magazines[1];
+
 static size_t alloc_memblocks(size_t length)
 {
-    if(free_base + (length << 12) > heap_limit) return 0;
-    size_t retval = free_base;
-    bool errored = false;
+    uint8_t* base = vmem_alloc(&heap_arena, length << 12);
 
-    for(; length > 0; length--)
+    if(base == KNULL)
+        return 0;
+
+    for(size_t i = 0; i < length; i++)
     {
         size_t phy_address = mm_alloc(1);
-        int status = mmu_map((void*)free_base, phy_address, MMU_FLAGS_DEFAULT);
+        int status = mmu_map(base + (i << 12), phy_address, MMU_FLAGS_DEFAULT);
 
         if(status != 0)
         {
-            errored = true;
-            klog_logln(LVL_ERROR, "Error mapping %p: %d", free_base, status);
-            break;
-        }
-        free_base += 0x1000;
-    }
+            klog_logln(LVL_ERROR, "Error mapping %p: %d", base + (i << 12), status);
 
-    if(errored)
-    {
-        // Various places in kernel code don't check for a null pointer, so just panic
-        kpanic("Could not allocate heap memory (Out of memory?)");
+            // Various places in kernel code don't check for a null pointer, so just panic
+            kpanic("Could not allocate heap memory (Out of memory?)");
+        }
     }
 
-    return retval;
+    return (size_t)base;
 }
 
-static void free_memblocks(size_t length)
+static void free_memblocks(void* base, size_t length)
 {
-    for(; length > 0 && free_base - (length << 12) > heap_base; length--)
-    {
-        free_base -= 0x1000;
-        mm_free(mmu_get_mapping((void*)free_base), 1);
-        mmu_unmap((void*)free_base, true);
-    }
+    // Give back the exact pages, wherever they are in the heap
+    for(size_t i = 0; i < length; i++)
+        mm_free(mmu_get_mapping((uint8_t*)base + (i << 12)), 1);
+
+    mmu_unmap_range(base, length << 12, true);
+    vmem_free(&heap_arena, base, length << 12);
 }
 
 void heap_init()
 {
-    heap_base = (uint64_t) get_heap_info()->base;
-    heap_limit = (uint64_t) (get_heap_info()->length + heap_base);
-    free_base = heap_base;
+    vmem_create(&heap_arena, "heap", get_heap_info()->base, get_heap_info()->length, PAGE_SIZE, 0);
 }
 
 /** This function is supposed to lock the memory data structures. It
@@ -104,6 +117,124 @@ int liballoc_unlock()
     return 0;
 }
 
+/*
+ * Gets the size class of an allocation, or -1 if it is too large for the magazines
+ */
+static int get_size_class(size_t size)
+{
+    int size_class = 0;
+
+    while((1UL << (size_class + MAGAZINE_MIN_SHIFT)) < size)
+        size_class++;
+
+    return size_class < MAGAZINE_CLASSES ? size_class : -1;
+}
+
+/*
+ * Takes the magazines of the current cpu
+ * Fails if they are already taken, which only happens if an interrupt or
+ * preemption happened while they were being changed
+ */
+static struct cpu_magazines* magazines_get()
+{
+    struct cpu_magazines* cpu_mags = &magazines[0];
+
+    if(lock_cmpxchg(&cpu_mags->busy, 0, 1) != 0)
+        return NULL;
+
+    return cpu_mags;
+}
+
+static void magazines_put(struct cpu_magazines* cpu_mags)
+{
+    lock_cmpxchg(&cpu_mags->busy, 1, 0);
+}
+
+size_t liballoc_magazine_round(size_t size)
+{
+    int size_class = get_size_class(size);
+
+    if(size == 0 || size_class < 0)
+        return size;
+
+    return 1UL << (size_class + MAGAZINE_MIN_SHIFT);
+}
+
+void* liballoc_magazine_alloc(size_t size)
+{
+    int size_class = get_size_class(size);
+    void* ptr = NULL;
+
+    if(size == 0 || size_class < 0)
+        return NULL;
+
+    struct cpu_magazines* cpu_mags = magazines_get();
+
+    if(cpu_mags == NULL)
+        return NULL;
+
+    if(cpu_mags->classes[size_class].count > 0)
+        ptr = cpu_mags->classes[size_class].rounds[--cpu_mags->classes[size_class].count];
+
+    magazines_put(cpu_mags);
+    return ptr;
+}
+
+int liballoc_magazine_free(void* ptr, size_t size)
+{
+    int size_class = get_size_class(size);
+    int status = 1;
+
+    // Only allocations rounded up by liballoc_magazine_round fit a class exactly
+    if(size_class < 0 || liballoc_magazine_round(size) != size)
+        return 1;
+
+    struct cpu_magazines* cpu_mags = magazines_get();
+
+    if(cpu_mags == NULL)
+        return 1;
+
+    if(cpu_mags->classes[size_class].count < MAGAZINE_ROUNDS)
+    {
+        cpu_mags->classes[size_class].rounds[cpu_mags->classes[size_class].count++] = ptr;
+        status = 0;
+    }
+
+    magazines_put(cpu_mags);
+    return status;
+}
+
+size_t liballoc_magazine_drain(size_t size, void** rounds, size_t max)
+{
+    int size_class = get_size_class(size);
+    size_t count = 0;
+
+    if(size_class < 0)
+        return 0;
+
+    struct cpu_magazines* cpu_mags = magazines_get();
+
+    if(cpu_mags == NULL)
+        return 0;
+
+    // The oldest rounds are at the bottom, and are the least likely to be reused soon
+    size_t* held = &cpu_mags->classes[size_class].count;
+    void** mag_rounds = cpu_mags->classes[size_class].rounds;
+
+    count = *held < max ? *held : max;
+
+    for(size_t i = 0; i < count; i++)
+        rounds[i] = mag_rounds[i];
+
+    for(size_t i = count; i < *held; i++)
+        mag_rounds[i - count] = mag_rounds[i];
+
+    *held -= count;
+
+    magazines_put(cpu_mags);
+    return count;
+}
+
 /** This is the hook into the local system which allocates pages. It
  * accepts an integer parameter which is the number of pages
  * required.  The page size was set up in the liballoc_init function.
@@ -126,6 +257,6 @@ void* liballoc_alloc(size_t num_pages)
  */
 int liballoc_free(void* base, size_t num_pages)
 {
-    free_memblocks(num_pages);
+    free_memblocks(base, num_pages);
     return 0;
 }
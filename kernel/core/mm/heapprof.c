@@ -0,0 +1,314 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <common/hal.h>
+#include <common/hal/timer.h>
+#include <common/mm/heapprof.h>
+#include <common/mm/liballoc.h>
+#include <common/util/ksym.h>
+#include <common/util/kfuncs.h>
+
+#ifdef ENABLE_HEAP_PROFILER
+
+#define OTHER_SITE  HEAPPROF_SITES  // Allocations from sites that didn't fit in the site table
+#define SHOWN_SITES 32
+
+struct alloc_site
+{
+    uintptr_t caller;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t total_bytes;
+    size_t live_bytes;
+    size_t peak_bytes;
+};
+
+struct live_alloc
+{
+    void* ptr;      // NULL if the slot is empty
+    uint32_t size;
+    uint16_t site;
+};
+
+static struct alloc_site sites[HEAPPROF_SITES + 1];
+static struct live_alloc live_allocs[HEAPPROF_TRACKED];
+static uint64_t size_histogram[HEAPPROF_BUCKETS];
+static uint64_t alloc_count = 0;
+static uint64_t free_count = 0;
+static uint64_t untracked_count = 0;
+
+// Last sample, for the rate
+static uint64_t last_sample_time = 0;
+static uint64_t last_alloc_count = 0;
+
+// Copy of the sites, sorted by live bytes when formatting
+static struct alloc_site site_snapshot[HEAPPROF_SITES + 1];
+
+static size_t get_bucket(size_t size)
+{
+    size_t bucket = 0;
+
+    while(bucket < HEAPPROF_BUCKETS - 1 && (16UL << bucket) < size)
+        bucket++;
+
+    return bucket;
+}
+
+static size_t live_slot(void* ptr)
+{
+    return ((uintptr_t)ptr >> 4) & (HEAPPROF_TRACKED - 1);
+}
+
+static uint16_t find_site(uintptr_t caller)
+{
+    size_t slot = (caller >> 2) % HEAPPROF_SITES;
+
+    for(size_t i = 0; i < HEAPPROF_SITES; i++, slot = (slot + 1) % HEAPPROF_SITES)
+    {
+        if(sites[slot].caller == caller)
+            return slot;
+
+        if(sites[slot].caller == 0)
+        {
+            sites[slot].caller = caller;
+            return slot;
+        }
+    }
+
+    return OTHER_SITE;
+}
+
+static void record_alloc(void* ptr, size_t size, void* caller)
+{
+    if(ptr == NULL)
+        return;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    uint16_t site = find_site((uintptr_t)caller);
+
+    alloc_count++;
+    size_histogram[get_bucket(size)]++;
+
+    sites[site].alloc_count++;
+    sites[site].total_bytes += size;
+    sites[site].live_bytes += size;
+    if(sites[site].live_bytes > sites[site].peak_bytes)
+        sites[site].peak_bytes = sites[site].live_bytes;
+
+    size_t slot = live_slot(ptr);
+
+    for(size_t i = 0; i < HEAPPROF_TRACKED; i++, slot = (slot + 1) & (HEAPPROF_TRACKED - 1))
+    {
+        if(live_allocs[slot].ptr == NULL)
+        {
+            live_allocs[slot].ptr = ptr;
+            live_allocs[slot].size = size;
+            live_allocs[slot].site = site;
+            hal_enable_interrupts(flags);
+            return;
+        }
+    }
+
+    // The frees of untracked allocations can't be attributed
+    untracked_count++;
+    hal_enable_interrupts(flags);
+}
+
+static void record_free(void* ptr)
+{
+    if(ptr == NULL)
+        return;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    size_t slot = live_slot(ptr);
+
+    free_count++;
+
+    for(size_t i = 0; i < HEAPPROF_TRACKED && live_allocs[slot].ptr != NULL; i++, slot = (slot + 1) & (HEAPPROF_TRACKED - 1))
+    {
+        if(live_allocs[slot].ptr != ptr)
+            continue;
+
+        struct alloc_site* site = &sites[live_allocs[slot].site];
+        site->free_count++;
+        site->live_bytes -= live_allocs[slot].size;
+        live_allocs[slot].ptr = NULL;
+
+        // Shift back the entries after the hole, so that lookups don't stop early
+        size_t hole = slot;
+        size_t next = (slot + 1) & (HEAPPROF_TRACKED - 1);
+
+        while(live_allocs[next].ptr != NULL)
+        {
+            size_t home = live_slot(live_allocs[next].ptr);
+
+            // Only move entries whose home isn't between the hole & them
+            if(((next - home) & (HEAPPROF_TRACKED - 1)) >= ((next - hole) & (HEAPPROF_TRACKED - 1)))
+            {
+                live_allocs[hole] = live_allocs[next];
+                live_allocs[next].ptr = NULL;
+                hole = next;
+            }
+
+            next = (next + 1) & (HEAPPROF_TRACKED - 1);
+        }
+
+        break;
+    }
+
+    hal_enable_interrupts(flags);
+}
+
+void* PREFIX(malloc)(size_t size)
+{
+    void* ptr = liballoc_raw_malloc(size);
+    record_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+void* PREFIX(realloc)(void* old_ptr, size_t size)
+{
+    void* ptr = liballoc_raw_realloc(old_ptr, size);
+
+    // The old allocation is only gone if the realloc succeeded
+    if(ptr != NULL || size == 0)
+        record_free(old_ptr);
+
+    record_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+void* PREFIX(calloc)(size_t nobj, size_t size)
+{
+    void* ptr = liballoc_raw_calloc(nobj, size);
+    record_alloc(ptr, nobj * size, __builtin_return_address(0));
+    return ptr;
+}
+
+void PREFIX(free)(void* ptr)
+{
+    record_free(ptr);
+    liballoc_raw_free(ptr);
+}
+
+size_t heapprof_format_info(char* buffer, size_t length)
+{
+    size_t index = 0;
+    uint64_t histogram[HEAPPROF_BUCKETS];
+    uint64_t allocs, frees, untracked;
+
+    if(length == 0)
+        return 0;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    memcpy(site_snapshot, sites, sizeof(sites));
+    memcpy(histogram, size_histogram, sizeof(histogram));
+    allocs = alloc_count;
+    frees = free_count;
+    untracked = untracked_count;
+    hal_enable_interrupts(flags);
+
+    uint64_t now = timer_read_counter(0);
+    uint64_t elapsed = now - last_sample_time;
+    uint64_t rate = elapsed == 0 ? 0 : ((allocs - last_alloc_count) * 1000000000ULL) / elapsed;
+
+    index = kappendf(buffer, length, index, "Allocs:    %8llu (%llu/s)\n", allocs, rate);
+    index = kappendf(buffer, length, index, "Frees:     %8llu\n", frees);
+    index = kappendf(buffer, length, index, "Untracked: %8llu\n", untracked);
+
+    index = kappendf(buffer, length, index, "Sizes:\n");
+    for(size_t i = 0; i < HEAPPROF_BUCKETS; i++)
+    {
+        if(i < HEAPPROF_BUCKETS - 1)
+            index = kappendf(buffer, length, index, "  <= %6lu %10llu\n", 16UL << i, histogram[i]);
+        else
+            index = kappendf(buffer, length, index, "  >  %6lu %10llu\n", 16UL << (i - 1), histogram[i]);
+    }
+
+    // Sort the sites by live bytes, only as far as they are shown
+    size_t site_count = HEAPPROF_SITES + 1;
+    size_t shown = 0;
+
+    for(; shown < SHOWN_SITES && shown < site_count; shown++)
+    {
+        size_t largest = shown;
+
+        for(size_t i = shown + 1; i < site_count; i++)
+        {
+            struct alloc_site* site = &site_snapshot[i];
+
+            // Sites with the same live bytes are ordered by their allocations
+            if(site->live_bytes > site_snapshot[largest].live_bytes ||
+               (site->live_bytes == site_snapshot[largest].live_bytes && site->alloc_count > site_snapshot[largest].alloc_count))
+                largest = i;
+        }
+
+        struct alloc_site temp = site_snapshot[shown];
+        site_snapshot[shown] = site_snapshot[largest];
+        site_snapshot[largest] = temp;
+
+        if(site_snapshot[shown].alloc_count == 0)
+            break;
+    }
+
+    index = kappendf(buffer, length, index, "%10s %10s %8s %8s  %s\n", "Live", "Peak", "Allocs", "Frees", "Site");
+    for(size_t i = 0; i < shown; i++)
+    {
+        struct alloc_site* site = &site_snapshot[i];
+        uintptr_t offset = 0;
+        const char* name = ksym_lookup(site->caller, &offset);
+
+        index = kappendf(buffer, length, index, "%10lu %10lu %8llu %8llu  ",
+                         (unsigned long)site->live_bytes,
+                         (unsigned long)site->peak_bytes,
+                         site->alloc_count,
+                         site->free_count);
+
+        if(site->caller == 0)
+            index = kappendf(buffer, length, index, "(other)\n");
+        else if(name != NULL)
+            index = kappendf(buffer, length, index, "%s+%#lx\n", name, (unsigned long)offset);
+        else
+            index = kappendf(buffer, length, index, "%p\n", (void*)site->caller);
+    }
+
+    last_sample_time = now;
+    last_alloc_count = allocs;
+
+    return index;
+}
+
+#else
+
+size_t heapprof_format_info(char* buffer, size_t length)
+{
+    size_t index = 0;
+
+    if(length == 0)
+        return 0;
+
+    index = kappendf(buffer, length, index, "The heap profiler isn't enabled (build with ENABLE_HEAP_PROFILER)\n");
+
+    return index;
+}
+
+#endif /* ENABLE_HEAP_PROFILER */
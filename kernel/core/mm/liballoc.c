@@ -1,4 +1,10 @@
 #include <common/mm/liballoc.h>
+
+#ifdef ENABLE_HEAP_PROFILER
+// kmalloc & friends are provided by the heap profiler, which wraps these
+#undef PREFIX
+#define PREFIX(func)        liballoc_raw_ ## func
+#endif
 //#define DEBUG
 
 /**  Durand's Amazing Super Duper Memory functions.  */
@@ -50,6 +56,8 @@
 #define LIBALLOC_MAGIC    0xc001c0de
 #define LIBALLOC_DEAD    0xdeaddead
 
+#define LIBALLOC_DRAIN_ROUNDS    16    ///< Blocks given back to the heap when a magazine overflows
+
 #if defined DEBUG || defined INFO
 //#include <stdio.h>
 #include <common/util/klog.h>
@@ -252,7 +260,22 @@ void *PREFIX(malloc)(size_t req_size)
     struct liballoc_major *maj;
     struct liballoc_minor *min;
     struct liballoc_minor *new_min;
-    unsigned long size = req_size;
+    unsigned long size;
+
+    // Small allocations are reused from the magazines first
+    p = liballoc_magazine_alloc( req_size );
+    if ( p != NULL )
+    {
+        // Blocks are marked dead while they sit in a magazine
+        min = (struct liballoc_minor*)p;
+        UNALIGN( min );
+        min = (struct liballoc_minor*)((uintptr_t)min - sizeof( struct liballoc_minor ));
+        min->magic = LIBALLOC_MAGIC;
+        return p;
+    }
+
+    req_size = liballoc_magazine_round( req_size );
+    size = req_size;
 
     // For alignment, we adjust size so there's enough space to align.
     if ( ALIGNMENT > 1 )
@@ -596,22 +619,15 @@ void *PREFIX(malloc)(size_t req_size)
 
 
 
-void PREFIX(free)(void *ptr)
+/*
+ * Frees a block back into its major, taking the lock.
+ * Small blocks given to the magazines never reach here until they are drained
+ */
+static void liballoc_release(void *ptr)
 {
     struct liballoc_minor *min;
     struct liballoc_major *maj;
 
-    if ( ptr == NULL )
-    {
-        l_warningCount += 1;
-        #if defined DEBUG || defined INFO
-        printf( "liballoc: WARNING: PREFIX(free)( NULL ) called from %x\n",
-                            __builtin_return_address(0) );
-        FLUSH();
-        #endif
-        return;
-    }
-
     UNALIGN( ptr );
 
     liballoc_lock();        // lockit
@@ -725,6 +741,62 @@ void PREFIX(free)(void *ptr)
 
 
 
+void PREFIX(free)(void *ptr)
+{
+    struct liballoc_minor *min;
+
+    if ( ptr == NULL )
+    {
+        l_warningCount += 1;
+        #if defined DEBUG || defined INFO
+        printf( "liballoc: WARNING: PREFIX(free)( NULL ) called from %x\n",
+                            __builtin_return_address(0) );
+        FLUSH();
+        #endif
+        return;
+    }
+
+    // Small allocations are kept in the magazines, without taking the lock
+    min = (struct liballoc_minor*)ptr;
+    UNALIGN( min );
+    min = (struct liballoc_minor*)((uintptr_t)min - sizeof( struct liballoc_minor ));
+
+    // The block is marked dead before it can be taken from the magazine again,
+    // so that freeing it twice is caught below, like any other double free
+    if ( min->magic == LIBALLOC_MAGIC )
+    {
+        min->magic = LIBALLOC_DEAD;
+
+        if ( liballoc_magazine_free( ptr, min->req_size ) == 0 )
+            return;
+
+        min->magic = LIBALLOC_MAGIC;
+
+        // A size class block only misses the magazine when it is full, so the
+        // oldest blocks go back into the heap along with this one, letting
+        // empty majors be released
+        void *rounds[LIBALLOC_DRAIN_ROUNDS];
+        size_t drained = 0;
+
+        if ( liballoc_magazine_round( min->req_size ) == min->req_size )
+            drained = liballoc_magazine_drain( min->req_size, rounds, LIBALLOC_DRAIN_ROUNDS );
+
+        for ( size_t i = 0; i < drained; i++ )
+        {
+            struct liballoc_minor *round = (struct liballoc_minor*)rounds[i];
+            UNALIGN( round );
+            round = (struct liballoc_minor*)((uintptr_t)round - sizeof( struct liballoc_minor ));
+            round->magic = LIBALLOC_MAGIC;
+
+            liballoc_release( rounds[i] );
+        }
+    }
+
+    liballoc_release( ptr );
+}
+
+
+
 void* PREFIX(calloc)(size_t nobj, size_t size)
 {
        int real_size;
@@ -20,12 +20,43 @@
 
 #include <string.h>
 
+#include <common/hal.h>
 #include <common/mm/mm.h>
+#include <common/mm/vmem.h>
 #include <common/util/kfuncs.h>
 
+#include <arch/iobase.h>
+
 #define BASE_SHIFT  12      // 4KiB
 #define BLOCK_SHIFT 27      // 128MiB
+#define BLOCK_PAGES (1 << (BLOCK_SHIFT - BASE_SHIFT))
+#define MAX_ORDER   (BLOCK_SHIFT - BASE_SHIFT)
 #define LAZY_BITMAP (0xFA1E000000000000ULL)
+#define INVALID_INDEX 0xFFFFFFFF
+
+#define MM_CPU_SLOTS 1      // TODO: Size by the number of cpus when doing SMP
+#define PCP_HIGH    64      // Frames held by a cache before it is drained
+#define PCP_BATCH   16      // Frames moved per refill or drain
+#define PCP_BATCH_ORDER 4
+#define ZERO_POOL_HIGH 64   // Frames kept zeroed by the idle thread
+
+#define DMA_LIMIT_PAGES 0x1000     // ISA DMA can only reach the first 16MiB
+#define ZONE_RESERVE_SHIFT 5    // Keep 1/32 of a zone back from fallback allocations
+#define MAX_NODE_RANGES 32
+#define NODE_DISTANCE_LOCAL 10
+#define NODE_DISTANCE_REMOTE 20
+
+#if defined(__x86_64__)
+#define PHYS_ADDR_BITS 46
+#else
+#define PHYS_ADDR_BITS 36
+#endif
+
+// Region index: A two level radix tree keyed by the region base
+#define INDEX_L2_SHIFT 9
+#define INDEX_L2_SIZE (1 << INDEX_L2_SHIFT)
+#define INDEX_L1_SIZE (1 << (PHYS_ADDR_BITS - BLOCK_SHIFT - INDEX_L2_SHIFT))
+#define INDEX_L1_QWORDS ((INDEX_L1_SIZE + 63) / 64)
 
 extern uintptr_t kernel_phystart;
 extern size_t kernel_physize;
@@ -51,9 +82,9 @@ struct mem_area
 };
 
 enum {
-    RTYPE_LOW,
-    RTYPE_32BIT,
-    RTYPE_64BIT,
+    RTYPE_LOW = MM_ZONE_DMA,
+    RTYPE_32BIT = MM_ZONE_32BIT,
+    RTYPE_64BIT = MM_ZONE_64BIT,
 };
 
 struct mem_flags
@@ -61,31 +92,144 @@ struct mem_flags
     uint64_t present : 1;
     uint64_t type : 2;
     uint64_t lazy_bitmap : 1;   // If the bitmap is lazily allocated
-    uint64_t reserved : 8;
+    uint64_t node : 6;          // NUMA node the region belongs to
+    uint64_t reserved : 2;
 } __attribute__((__packed__));
 typedef struct mem_flags mem_flags_t;
 
+/*
+ * Regions grouped by their type. Zones are indexed by enum mm_zone, which
+ * lines up with the region types. The low zone holds the first region, but
+ * only the first 16MiB of it can be handed out as MM_ZONE_DMA, and so only
+ * those pages are counted in it. The rest of the region is counted in the
+ * 32-bit zone, but is only reached by falling back onto the low zone.
+ */
+struct mem_zone
+{
+    uint64_t first_block;   // First region in the zone
+    uint64_t end_block;     // Region after the last one in the zone
+    size_t total_pages;
+    size_t free_pages;
+};
+
+static struct mem_zone zones[MM_ZONE_COUNT] = {
+    [MM_ZONE_DMA]   = { .first_block = 0, .end_block = 1 },
+    [MM_ZONE_32BIT] = { .first_block = 1, .end_block = (1ULL << 32) >> BLOCK_SHIFT },
+    [MM_ZONE_64BIT] = { .first_block = (1ULL << 32) >> BLOCK_SHIFT, .end_block = ~0ULL },
+};
+
+/*
+ * Range of regions local to a NUMA node. Without any ranges, everything is
+ * on node 0.
+ */
+struct node_range
+{
+    uint64_t first_block;
+    uint64_t end_block;
+    unsigned int node;
+};
+
+static struct node_range node_ranges[MAX_NODE_RANGES];
+static size_t num_node_ranges = 0;
+static unsigned int num_nodes = 1;
+
+// Distances from the SLIT, or 0 if unknown
+static uint8_t node_distance[MM_MAX_NODES][MM_MAX_NODES];
+// Nodes ordered from the nearest to the furthest, for every node
+static uint8_t node_order[MM_MAX_NODES][MM_MAX_NODES];
+static bool node_order_valid = false;
+
+/*
+ * Buddy free maps of a region. Each order has its own bitmap, where a set bit
+ * means that the block of that order is free and not merged with its buddy.
+ * Orders 0-9 take up 1023 qwords, and orders 10-15 take up a qword each.
+ */
+#define BUDDY_MAP_QWORDS 1029
+
+struct buddy_map
+{
+    // Bit n set if the n-th qword group of the order bitmap has a free block
+    uint64_t super_map[MAX_ORDER + 1];
+    uint64_t bitmap[BUDDY_MAP_QWORDS];
+};
+
+#define BUDDY_MAP_PAGES ((sizeof(struct buddy_map) + 0xFFF) >> 12)
+
+static const uint16_t order_base[MAX_ORDER + 1] = {
+    0, 512, 768, 896, 960, 992, 1008, 1016, 1020, 1022, 1023, 1024, 1025, 1026, 1027, 1028
+};
+
 struct mem_block
 {
     struct mem_block* next;
-    uint64_t* bitmap;
-    uint64_t super_map;
+    struct buddy_map* bitmap;
+    uint16_t order_map;     // Bit n set if there is a free block of order n
+    uint16_t free_pages;
+    uint32_t padding;
 
     uint64_t base : 48;
     mem_flags_t flags;
 } __attribute__((__packed__));
 typedef struct mem_block mem_region_t;
 
+/*
+ * Leaf of the region index. Besides the regions, it has a bitmap per order of
+ * the regions that have a free block of that order.
+ */
+struct region_node
+{
+    uint64_t free_map[MAX_ORDER + 1][INDEX_L2_SIZE / 64];
+    mem_region_t* regions[INDEX_L2_SIZE];
+    uint16_t* share_counts[INDEX_L2_SIZE];  // Extra owners of each frame, only allocated once a frame is shared
+};
+
+#define REGION_NODE_PAGES ((sizeof(struct region_node) + 0xFFF) >> 12)
+#define SHARE_MAP_PAGES ((BLOCK_PAGES * sizeof(uint16_t) + 0xFFF) >> 12)
+
 static uint8_t __attribute__((aligned (4096))) init_region_list[4096];
-static uint8_t __attribute__((aligned (4096))) init_region_bitmap[4096];
+static struct buddy_map __attribute__((aligned (4096))) init_region_bitmap;
+static struct region_node __attribute__((aligned (4096))) init_region_node;
+
+static struct region_node* region_index[INDEX_L1_SIZE];
+// Bit n set if region_index[n] has a region with a free block of the order
+static uint64_t index_summary[MAX_ORDER + 1][INDEX_L1_QWORDS];
+// Bit n set if index_summary[order][n] is non-zero
+static uint64_t index_top[MAX_ORDER + 1];
+
+/*
+ * Per-cpu cache of single frames. The top of the stack holds the most recently
+ * freed (hot) frames, and the bottom holds the cold ones that are drained first.
+ */
+struct pcp_cache
+{
+    unsigned long frames[PCP_HIGH];
+    size_t count;
+};
+
+static struct pcp_cache pcp_caches[MM_CPU_SLOTS];
+
+/*
+ * Frames which have already been zeroed, filled up while idle
+ */
+static struct
+{
+    unsigned long frames[ZERO_POOL_HIGH];
+    size_t count;
+} zero_pool;
+
+// Scratch page used to zero frames
+static void* zero_window = NULL;
+
+// Allocation counters reported by mm_get_stats
+static struct mm_counters mm_counters;
 
 static struct mem_area area_list[64];
 static unsigned int next_free_area = 0;
 
-static mem_region_t* region_list = (mem_region_t*)&init_region_bitmap;
+static mem_region_t* region_list = (mem_region_t*)&init_region_list;
 static size_t frame_blocks = 0;
 
-static void* mm_base_ptr = NULL;
+static vmem_t mm_arena;
 
 // List utilities (TODO: Abstract away into a new file)
 /*
@@ -121,454 +265,1529 @@ static void list_insert_after(mem_region_t* list_head, mem_region_t* insert)
     list_get_tail(insert)->next = next_item;
 }
 
+static void* get_next_address(size_t pages)
+{
+    void* addr = vmem_alloc(&mm_arena, (size_t)pages << BASE_SHIFT);
+
+    if(addr == KNULL)
+        kpanic("Out of address space for the memory manager");
+
+    return addr;
+}
+
+// Region index utilities
 /*
- * Searches list for a memory block which contains the address
- * Returns the block which matches the requirements, or KNULL if none was found
+ * Finds the region which contains the address
+ * Returns the region, or KNULL if none was found
  */
-static mem_region_t* list_search_block(mem_region_t* list_head, uint64_t addr)
+static mem_region_t* index_lookup(uint64_t addr)
 {
-    // TODO: Abstract away into a macro
-    mem_region_t* block = list_head;
+    uint64_t block = addr >> BLOCK_SHIFT;
 
-    while(block != KNULL)
-    {
-        if(addr >> BLOCK_SHIFT == block->base) break;
-        block = block->next;
-    }
+    if(block >= ((uint64_t)INDEX_L1_SIZE << INDEX_L2_SHIFT))
+        return KNULL;
+
+    struct region_node* node = region_index[block >> INDEX_L2_SHIFT];
+    if(node == NULL || node->regions[block & (INDEX_L2_SIZE - 1)] == NULL)
+        return KNULL;
 
-    return block;
+    return node->regions[block & (INDEX_L2_SIZE - 1)];
 }
 
 /*
- * Searches list for the first free memory block
- * Returns the first free block, or KNULL if none was found
+ * Adds a region to the index, allocating a leaf if needed
  */
-static mem_region_t* list_search_free(mem_region_t* list_head)
+static void index_insert(mem_region_t* region)
 {
-    // TODO: Abstract away into a macro
-    mem_region_t* block = list_head;
+    uint64_t block = region->base;
 
-    while(block != KNULL)
+    if(block >= ((uint64_t)INDEX_L1_SIZE << INDEX_L2_SHIFT))
+        kpanic("Region %p is outside of the physical address space", (uintptr_t)block << BLOCK_SHIFT);
+
+    struct region_node** node = &region_index[block >> INDEX_L2_SHIFT];
+
+    if(*node == NULL)
     {
-        if(block->super_map != 0xFFFFFFFFFFFFFFFFULL && block->flags.present)
-            break;
-        block = block->next;
+        if((block >> INDEX_L2_SHIFT) == 0)
+        {
+            *node = &init_region_node;
+        }
+        else
+        {
+            *node = get_next_address(REGION_NODE_PAGES);
+
+            for(size_t i = 0; i < REGION_NODE_PAGES; i++)
+                mmu_map((uint8_t*)*node + (i << BASE_SHIFT), mm_alloc(1), MMU_FLAGS_DEFAULT);
+        }
+
+        memset(*node, 0x00, sizeof(struct region_node));
     }
 
-    return block;
+    (*node)->regions[block & (INDEX_L2_SIZE - 1)] = region;
 }
 
 /*
- * Appends a new block to the list. Automatically allocates frames to the list
- * if needed.
- * Returns true if a new pointer block was allocated
+ * Gets the number of extra owners of a frame, allocating the region's counts if needed
+ * Returns NULL if the frame isn't in a region, or the region has no counts and create is false
  */
-static bool mm_append_block(mem_region_t* list_head, mem_region_t* block)
+static uint16_t* get_share_count(unsigned long frame, bool create)
 {
-    list_insert_after(list_head, block);
-    return false;
-}
+    uint64_t block = frame >> BLOCK_SHIFT;
 
-// Bitmap utilities
-typedef union
-{
-    struct
-    {
-        uint16_t bit_index : 6;
-        uint16_t qword_index : 9;
-    };
-    uint16_t value;
-} bm_index_t;
+    if(block >= ((uint64_t)INDEX_L1_SIZE << INDEX_L2_SHIFT))
+        return NULL;
 
-typedef union
-{
-    struct
-    {
-        uint16_t padding : 9;
-        uint16_t bit_index : 6;
-    };
-    uint16_t value;
-} sbm_index_t;
+    struct region_node* node = region_index[block >> INDEX_L2_SHIFT];
+    if(node == NULL || node->regions[block & (INDEX_L2_SIZE - 1)] == NULL)
+        return NULL;
 
-static void bm_set_bit(mem_region_t* mem_block, size_t index)
-{
-    if(mem_block == KNULL) return;
-    if(index >= 32768)
-    {
-        // TODO: Alert our things
-        return;
-    }
+    uint16_t** counts = &node->share_counts[block & (INDEX_L2_SIZE - 1)];
 
-    if(mem_block->flags.lazy_bitmap)
+    if(*counts == NULL)
     {
-        // TODO: Canabalize the mm_free zero page & use it to allocate another page
-        kpanic("GORP");
-    }
+        if(!create)
+            return NULL;
 
-    bm_index_t bm_index = {.value = index};
-    sbm_index_t sbm_index = {.value = index};
+        *counts = get_next_address(SHARE_MAP_PAGES);
 
-    mem_block->bitmap[bm_index.qword_index] |= (1ULL << bm_index.bit_index);
+        for(size_t i = 0; i < SHARE_MAP_PAGES; i++)
+            mmu_map((uint8_t*)*counts + (i << BASE_SHIFT), mm_alloc(1), MMU_FLAGS_DEFAULT);
 
-    // Check superblocks
-    bool sbi_full = true;
-    for(uint16_t i = 0; i < 0b111; i++)
-    {
-        if(mem_block->bitmap[(bm_index.qword_index & ~0x7ULL) + i] != ~0ULL)
-            return;
+        memset(*counts, 0x00, SHARE_MAP_PAGES << BASE_SHIFT);
     }
 
-    if(sbi_full) mem_block->super_map |= (1ULL << sbm_index.bit_index);
+    return &(*counts)[(frame >> BASE_SHIFT) & (BLOCK_PAGES - 1)];
 }
 
-static void bm_clear_bit(mem_region_t* mem_block, size_t index)
+/*
+ * Updates the free blocks of a region, along with the index summaries
+ */
+static void region_set_order_map(mem_region_t* region, uint16_t order_map)
 {
-    if(mem_block == KNULL) return;
-    if(index >= 32768)
+    uint16_t changed = region->order_map ^ order_map;
+    uint64_t block = region->base;
+    size_t l1 = block >> INDEX_L2_SHIFT;
+    size_t l2 = block & (INDEX_L2_SIZE - 1);
+    struct region_node* node = region_index[l1];
+
+    region->order_map = order_map;
+
+    while(changed != 0)
     {
-        // TODO: Alert our things
-        return;
-    }
+        unsigned int order = __builtin_ctz(changed);
+        changed &= ~(1 << order);
 
-    // We shouldn't be able to free from lazily allocated pages...
-    if(mem_block->flags.lazy_bitmap)
-        kpanic("Bad mm_free address (%p, %x)", mem_block, index);
+        if(order_map & (1 << order))
+        {
+            node->free_map[order][l2 >> 6] |= (1ULL << (l2 & 0x3F));
+            index_summary[order][l1 >> 6] |= (1ULL << (l1 & 0x3F));
+            index_top[order] |= (1ULL << (l1 >> 6));
+            continue;
+        }
+
+        node->free_map[order][l2 >> 6] &= ~(1ULL << (l2 & 0x3F));
+
+        for(size_t i = 0; i < INDEX_L2_SIZE / 64; i++)
+        {
+            if(node->free_map[order][i] != 0)
+                goto next_order;
+        }
 
-    bm_index_t bm_index = {.value = index};
-    sbm_index_t sbm_index = {.value = index};
+        index_summary[order][l1 >> 6] &= ~(1ULL << (l1 & 0x3F));
 
-    mem_block->bitmap[bm_index.qword_index] &= ~(1ULL << bm_index.bit_index);
-    mem_block->super_map &= ~(1ULL << sbm_index.bit_index);
+        if(index_summary[order][l1 >> 6] == 0)
+            index_top[order] &= ~(1ULL << (l1 >> 6));
+
+    next_order:
+        continue;
+    }
 }
 
-static uint8_t bm_get_bit(mem_region_t* mem_block, size_t index)
+/*
+ * Finds the first region at or after the start block with a free block of
+ * exactly the given order
+ * Returns the region, or KNULL if none was found
+ */
+static mem_region_t* index_find_order(unsigned int order, uint64_t start)
 {
-    if(mem_block == KNULL) return 1;
-    if(index >= 32768)
+    size_t l1 = start >> INDEX_L2_SHIFT;
+
+    while(l1 < INDEX_L1_SIZE)
     {
-        // TODO: Alert our things
-        return 1;
-    }
+        uint64_t summary = index_summary[order][l1 >> 6] & (~0ULL << (l1 & 0x3F));
 
-    if(mem_block->flags.lazy_bitmap)
-        // Lazily allocated pages are free pages
-        return 0;
+        if(summary == 0)
+        {
+            // Skip to the next summary qword with any free regions
+            size_t next_qword = (l1 >> 6) + 1;
+            uint64_t top = next_qword < 64 ? (index_top[order] & (~0ULL << next_qword)) : 0;
 
-    bm_index_t bm_index = {.value = index};
-    return (uint8_t) (mem_block->bitmap[bm_index.qword_index] >> (bm_index.bit_index)) & 0x1;
-}
+            if(top == 0)
+                return KNULL;
 
-static uint8_t bm_test_bit(uint64_t bitmap, size_t index)
-{
-    if(index > 64) return 1;
-    return (uint8_t) ((bitmap >> index) & 0x1);
-}
+            l1 = (size_t)__builtin_ctzll(top) << 6;
+            continue;
+        }
 
-static size_t bm_find_free_bits(mem_region_t* mem_block, size_t size)
-{
-    bm_index_t index = {.value = 0xFFFF};
-    sbm_index_t sbm_index = {.value = 0x0000};
-    size_t num_free_bits = 0;
+        l1 = (l1 & ~0x3FUL) + __builtin_ctzll(summary);
+        struct region_node* node = region_index[l1];
+        size_t first = (l1 == (start >> INDEX_L2_SHIFT)) ? (start & (INDEX_L2_SIZE - 1)) : 0;
 
-    for(size_t sb_index = 0; sb_index < 64; sb_index++)
-    {
-        if(bm_test_bit(mem_block->super_map, sb_index) == 0)
+        for(size_t i = first >> 6; i < INDEX_L2_SIZE / 64; i++)
         {
-            sbm_index.bit_index = sb_index;
-            index.value = sbm_index.bit_index;
+            uint64_t bits = node->free_map[order][i];
 
-            for(size_t i = 0; i < 512; i++)
-            {
-                index.bit_index = i & 0x3F;
-                index.qword_index = (i >> 6) | (sbm_index.value >> 6);
+            if(i == (first >> 6))
+                bits &= (~0ULL << (first & 0x3F));
 
-                if(bm_get_bit(mem_block, index.value) == 0)
-                {
-                    if(++num_free_bits >= size) break;
-                } else
-                {
-                    num_free_bits = 0;
-                }
-            }
+            if(bits != 0)
+                return node->regions[(i << 6) + __builtin_ctzll(bits)];
         }
 
-        if(num_free_bits == 0) index.value = 0xFFFF;
-        else if(num_free_bits >= size) break;
+        l1++;
     }
 
-    return (size_t)index.value;
+    return KNULL;
 }
 
-static void* get_next_address()
+/*
+ * Finds a region between the first and end blocks with a free block of at
+ * least the given order, preferring regions with the smallest fitting block
+ * Returns the region, or KNULL if none was found
+ */
+static mem_region_t* index_find_free(unsigned int order, uint64_t first_block, uint64_t end_block)
 {
-    void * addr = mm_base_ptr;
-    mm_base_ptr += (uintptr_t)((void*)4096);
-    return addr;
+    for(; order <= MAX_ORDER; order++)
+    {
+        if(index_top[order] == 0)
+            continue;
+
+        mem_region_t* region = index_find_order(order, first_block);
+        if(region != KNULL && region->base < end_block)
+            return region;
+    }
+
+    return KNULL;
 }
 
 /*
- * Creates a region block and appends it to list_tail.
- * Base to be passed should be base >> 27 (size of region coverage).
+ * Appends a new block to the list. Automatically allocates frames to the list
+ * if needed.
+ * Returns true if a new pointer block was allocated
  */
-static mem_region_t* mm_create_region(mem_region_t* list_tail,
-                                      uint64_t base)
+static bool mm_append_block(mem_region_t* list_head, mem_region_t* block)
 {
-    mem_region_t* append = KNULL;
-    if(++frame_blocks >= 128)
-    {
-        // Map a new pointer list
-        append = get_next_address();
+    list_insert_after(list_head, block);
+    return false;
+}
 
-        if(frame_blocks % 128 == 0)
-            mmu_map(append, mm_alloc(1), MMU_FLAGS_DEFAULT);
-        frame_blocks = 0;
-    }
-    else
+static void mm_materialise_region(mem_region_t* region, size_t map_page);
+static unsigned long zone_alloc(size_t size, enum mm_zone zone, size_t align, unsigned int node);
+
+// Buddy bitmap utilities
+/*
+ * Number of bitmap qwords covered by a single super_map bit
+ */
+static inline unsigned int bm_group_shift(unsigned int order)
+{
+    // Orders 0-2 have more than 64 qwords, so group them into 64 super bits
+    return order < 3 ? 3 - order : 0;
+}
+
+static void bm_set_free(mem_region_t* mem_block, unsigned int order, size_t index)
+{
+    struct buddy_map* map = mem_block->bitmap;
+
+    map->bitmap[order_base[order] + (index >> 6)] |= (1ULL << (index & 0x3F));
+    map->super_map[order] |= (1ULL << ((index >> 6) >> bm_group_shift(order)));
+    region_set_order_map(mem_block, mem_block->order_map | (1 << order));
+}
+
+static void bm_clear_free(mem_region_t* mem_block, unsigned int order, size_t index)
+{
+    struct buddy_map* map = mem_block->bitmap;
+    unsigned int shift = bm_group_shift(order);
+    size_t group = (index >> 6) >> shift;
+
+    map->bitmap[order_base[order] + (index >> 6)] &= ~(1ULL << (index & 0x3F));
+
+    // Check if the rest of the group is empty
+    for(size_t i = 0; i < (1U << shift); i++)
     {
-        // Keep on using the current structure
-        append = (mem_region_t*)((size_t)list_tail + sizeof(mem_region_t));
+        if(map->bitmap[order_base[order] + (group << shift) + i] != 0)
+            return;
     }
 
-    append->next = KNULL;
-    append->base = base;
-    append->super_map = ~0ULL;
-
-    if(base == 0x0)
-        append->flags.type = RTYPE_LOW;
-    else if(base <= 32)
-        append->flags.type = RTYPE_32BIT;
-    else
-        append->flags.type = RTYPE_64BIT;
+    map->super_map[order] &= ~(1ULL << group);
 
-    append->flags.reserved = 0x0;
-    append->flags.present = 0;
-    append->flags.lazy_bitmap = 1;
-    append->bitmap = (uint64_t*)LAZY_BITMAP;
+    if(map->super_map[order] == 0)
+        region_set_order_map(mem_block, mem_block->order_map & ~(1 << order));
+}
 
-    append->flags.present = 1;
-    mm_append_block(list_tail, append);
-    return append;
+static uint8_t bm_test_free(mem_region_t* mem_block, unsigned int order, size_t index)
+{
+    uint64_t qword = mem_block->bitmap->bitmap[order_base[order] + (index >> 6)];
+    return (uint8_t) (qword >> (index & 0x3F)) & 0x1;
 }
 
-/**
- * @brief  Finds memory area containg the address
- * @note   
- * @param  address: The address to find the containing area
- * @retval The containing area, or NULL if none was found
+/*
+ * Finds the last free block of the given order
+ * Returns the block index, or INVALID_INDEX if none was found
  */
-static struct mem_area* find_area(unsigned long address)
+static size_t bm_find_last_free(mem_region_t* mem_block, unsigned int order)
 {
-    for(size_t i = 0; i < next_free_area; i++)
+    struct buddy_map* map = mem_block->bitmap;
+    unsigned int shift = bm_group_shift(order);
+
+    if(map->super_map[order] == 0)
+        return INVALID_INDEX;
+
+    size_t group = 63 - __builtin_clzll(map->super_map[order]);
+
+    for(size_t i = (1U << shift); i > 0; i--)
     {
-        struct mem_area* check = &(area_list[i]);
+        size_t qword_index = (group << shift) + i - 1;
+        uint64_t qword = map->bitmap[order_base[order] + qword_index];
 
-        if(address >= check->base && address < (check->base + check->length))
-            return check;
+        if(qword != 0)
+            return (qword_index << 6) + (63 - __builtin_clzll(qword));
     }
 
-    return NULL;
+    return INVALID_INDEX;
 }
 
-void mm_early_init()
+/*
+ * Finds the first free block of the given order
+ * Returns the block index, or INVALID_INDEX if none was found
+ */
+static size_t bm_find_free(mem_region_t* mem_block, unsigned int order)
 {
-    // Reserve appropriate regions
-    // Null page
-    mm_add_area(0, 0x1000, TYPE_RESERVED);
+    struct buddy_map* map = mem_block->bitmap;
+    unsigned int shift = bm_group_shift(order);
 
-    // Kernel region
-    mm_add_area((uintptr_t)&kernel_phystart, (size_t)&kernel_physize, TYPE_RESERVED);
+    if(map->super_map[order] == 0)
+        return INVALID_INDEX;
 
-    // Initrd area
-    mm_add_area(initrd_start, initrd_size, TYPE_RESERVED);
+    size_t group = __builtin_ctzll(map->super_map[order]);
 
-    // Setup the bitmap
-    mem_region_t* node = (mem_region_t*)&init_region_list;
-    region_list = node;
+    for(size_t i = 0; i < (1U << shift); i++)
+    {
+        size_t qword_index = (group << shift) + i;
+        uint64_t qword = map->bitmap[order_base[order] + qword_index];
 
-    memset(init_region_list, 0, sizeof(init_region_list));
-    memset(init_region_bitmap, 0xFF, sizeof(init_region_bitmap));
+        if(qword != 0)
+            return (qword_index << 6) + __builtin_ctzll(qword);
+    }
 
-    node->next = KNULL;
-    node->base = 0;
-    node->super_map = 0xFFFFFFFFFFFFFFFFULL;
-    node->flags.type = RTYPE_LOW;
-    node->flags.reserved = 0x00U;
-    node->flags.present = 1;
-    node->flags.lazy_bitmap = 0;
-    node->bitmap = (uint64_t*)&init_region_bitmap;
+    return INVALID_INDEX;
+}
+
+/*
+ * Gets the zone a page in the region belongs to. Only the first 16MiB of
+ * the low region are in the DMA zone, the rest of it is in the 32-bit zone.
+ */
+static enum mm_zone region_zone(mem_region_t* region, size_t page)
+{
+    if(region->flags.type == RTYPE_LOW && page >= DMA_LIMIT_PAGES)
+        return MM_ZONE_32BIT;
 
-    mm_base_ptr = mm_get_base();
+    return (enum mm_zone)region->flags.type;
+}
 
-    klog_logln(LVL_INFO, "Complete list:");
-    for(size_t i = 0; i < next_free_area; i++)
+/*
+ * Adds a run of pages in the region to the free or total counts of the
+ * zones it lies in
+ */
+static void zone_add_run(mem_region_t* region, size_t page, long pages, bool total)
+{
+    long sign = pages < 0 ? -1 : 1;
+    size_t count = pages * sign;
+
+    while(count > 0)
     {
-        struct mem_area* area = &(area_list[i]);
+        enum mm_zone zone = region_zone(region, page);
+        size_t run = count;
 
-        if(!area->type)
-            continue;
-        klog_logln(LVL_INFO, "    %08.8p | %08.8p | %01d", area->base, area->length, area->type);
-        mm_add_region(area->base, area->length, area->type);
+        if(zone == MM_ZONE_DMA && page + run > DMA_LIMIT_PAGES)
+            run = DMA_LIMIT_PAGES - page;
+
+        if(total)
+            zones[zone].total_pages += run * sign;
+        else
+            zones[zone].free_pages += run * sign;
+
+        page += run;
+        count -= run;
     }
 }
 
-void mm_init()
+static void region_add_free(mem_region_t* mem_block, size_t page, long pages)
 {
-    heap_init();
+    mem_block->free_pages += pages;
+    zone_add_run(mem_block, page, pages, false);
 }
 
-static void add_area(unsigned long base, unsigned long length, uint32_t type)
+/*
+ * Takes a free block out of the buddy maps, splitting it down to the
+ * requested order
+ * Returns the page index of the block
+ */
+static size_t buddy_take(mem_region_t* mem_block, unsigned int found_order, size_t index, unsigned int order)
 {
-    if(next_free_area >= 64)
-        return;
+    bm_clear_free(mem_block, found_order, index);
 
-    struct mem_area* area = &(area_list[next_free_area++]);
-    area->base = base;
-    area->length = length;
-    area->type = type;
+    // Split down to the requested order, freeing the upper halves
+    while(found_order > order)
+    {
+        found_order--;
+        index <<= 1;
+        bm_set_free(mem_block, found_order, index | 1);
+    }
 
-    klog_logln(LVL_INFO, "      : %08.8p | %08.8p | %01d", base, length, type);
+    region_add_free(mem_block, index << order, -(1L << order));
+    return index << order;
 }
 
-void mm_add_area(unsigned long base, unsigned long length, uint32_t type)
+/*
+ * Allocates a block of 2^order pages from the region, splitting larger
+ * blocks as needed. The highest free block is used, so that the low pages
+ * are kept for allocations which need them.
+ * Returns the page index of the block, or INVALID_INDEX if there was no space
+ */
+static size_t buddy_alloc(mem_region_t* mem_block, unsigned int order)
 {
-    klog_logln(LVL_INFO, "Create: %08.8p | %08.8p | %01d", base, length, type);
-
-    // Cut out overlapping regiojn
-    struct mem_area* base_overlap = find_area(base);
-    struct mem_area* limit_overlap = find_area(base + length);
+    if((mem_block->order_map >> order) == 0)
+        return INVALID_INDEX;
 
-    if(limit_overlap != NULL)
+    if(mem_block->flags.lazy_bitmap)
+    {
+        if(order == MAX_ORDER)
+        {
+            // Whole region, no need for the buddy maps
+            region_set_order_map(mem_block, 0);
+            region_add_free(mem_block, 0, -(long)mem_block->free_pages);
+            return 0;
+        }
+
+        mm_materialise_region(mem_block, INVALID_INDEX);
+    }
+
+    unsigned int found_order = order + __builtin_ctz(mem_block->order_map >> order);
+    size_t index = bm_find_last_free(mem_block, found_order);
+
+    if(index == INVALID_INDEX)
+        return INVALID_INDEX;
+
+    return buddy_take(mem_block, found_order, index, order);
+}
+
+/*
+ * Allocates a block of 2^order pages which ends at or below the page limit,
+ * using the lowest free block that fits
+ * Returns the page index of the block, or INVALID_INDEX if there was no space
+ */
+static size_t buddy_alloc_below(mem_region_t* mem_block, unsigned int order, size_t limit)
+{
+    if((mem_block->order_map >> order) == 0)
+        return INVALID_INDEX;
+
+    if(mem_block->flags.lazy_bitmap)
+        mm_materialise_region(mem_block, INVALID_INDEX);
+
+    for(unsigned int found_order = order; found_order <= MAX_ORDER; found_order++)
+    {
+        size_t index = bm_find_free(mem_block, found_order);
+
+        if(index == INVALID_INDEX)
+            continue;
+
+        // The lower half is kept while splitting, so only the start matters
+        if((index << found_order) + (1UL << order) <= limit)
+            return buddy_take(mem_block, found_order, index, order);
+    }
+
+    return INVALID_INDEX;
+}
+
+/*
+ * Allocates a block of 2^order pages from the region which starts at or
+ * above the given page
+ * Returns the page index of the block, or INVALID_INDEX if there was no space
+ */
+static size_t buddy_alloc_above(mem_region_t* mem_block, unsigned int order, size_t first)
+{
+    if((mem_block->order_map >> order) == 0)
+        return INVALID_INDEX;
+
+    if(mem_block->flags.lazy_bitmap)
+        mm_materialise_region(mem_block, INVALID_INDEX);
+
+    for(unsigned int found_order = order; found_order <= MAX_ORDER; found_order++)
+    {
+        size_t index = bm_find_last_free(mem_block, found_order);
+
+        if(index == INVALID_INDEX)
+            continue;
+
+        if((index << found_order) >= first)
+            return buddy_take(mem_block, found_order, index, order);
+    }
+
+    return INVALID_INDEX;
+}
+
+/*
+ * Frees a block of 2^order pages into the region, merging it with any free
+ * buddies
+ */
+static void buddy_free(mem_region_t* mem_block, size_t page, unsigned int order)
+{
+    size_t index = page >> order;
+
+    if(mem_block->flags.lazy_bitmap)
+    {
+        if(order == MAX_ORDER && mem_block->order_map == 0)
+        {
+            // Whole region, no need for the buddy maps
+            region_set_order_map(mem_block, (1 << MAX_ORDER));
+            region_add_free(mem_block, 0, BLOCK_PAGES);
+            return;
+        }
+
+        mm_materialise_region(mem_block, INVALID_INDEX);
+    }
+
+    if(bm_test_free(mem_block, order, index))
+        kpanic("Double mm_free (%p, %x)", mem_block, page);
+
+    region_add_free(mem_block, page, 1L << order);
+
+    while(order < MAX_ORDER && bm_test_free(mem_block, order, index ^ 1))
+    {
+        bm_clear_free(mem_block, order, index ^ 1);
+        index >>= 1;
+        order++;
+    }
+
+    bm_set_free(mem_block, order, index);
+}
+
+/*
+ * Checks if the page is inside of a free block in the buddy maps
+ */
+static bool buddy_page_free(mem_region_t* mem_block, size_t page)
+{
+    // Lazy regions are either entirely free, or haven't been given any pages
+    if(mem_block->flags.lazy_bitmap)
+        return (mem_block->order_map & (1 << MAX_ORDER)) != 0;
+
+    for(unsigned int order = 0; order <= MAX_ORDER; order++)
+    {
+        if((mem_block->order_map & (1 << order)) && bm_test_free(mem_block, order, page >> order))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Frees an arbitrary run of pages as the largest aligned blocks possible
+ */
+static void buddy_free_range(mem_region_t* mem_block, size_t page, size_t count)
+{
+    if(page + count > BLOCK_PAGES)
+    {
+        // TODO: Alert our things
+        return;
+    }
+
+    if(mem_block->flags.lazy_bitmap && mem_block->order_map == 0 && count < BLOCK_PAGES && count >= BUDDY_MAP_PAGES)
+    {
+        // Keep the buddy maps in the pages being freed
+        mm_materialise_region(mem_block, page);
+        page += BUDDY_MAP_PAGES;
+        count -= BUDDY_MAP_PAGES;
+    }
+
+    while(count > 0)
+    {
+        unsigned int order = MAX_ORDER;
+
+        if(page != 0)
+            order = __builtin_ctz(page);
+
+        while((1UL << order) > count)
+            order--;
+
+        buddy_free(mem_block, page, order);
+        page += (1 << order);
+        count -= (1 << order);
+    }
+}
+
+static unsigned int size_to_order(size_t size)
+{
+    unsigned int order = 0;
+
+    while((1UL << order) < size)
+        order++;
+
+    return order;
+}
+
+/*
+ * Gets a pointer to the buddy maps in the given frames, preferably through the
+ * direct map
+ */
+static struct buddy_map* map_buddy_map(unsigned long frames)
+{
+    struct buddy_map* map = mmu_phys_to_virt(frames);
+
+    if(map != KNULL)
+        return map;
+
+    map = get_next_address(BUDDY_MAP_PAGES);
+    mmu_map_range(map, frames, BUDDY_MAP_PAGES << BASE_SHIFT, MMU_FLAGS_DEFAULT);
+    return map;
+}
+
+/*
+ * Allocates the buddy maps of a lazily allocated region.
+ * Lazy regions are either completely free or completely allocated. The maps
+ * are kept in the region's own pages, which are taken out of the zone's
+ * total: the first pages for a free region, or the free pages at map_page
+ * for an allocated one. Allocated regions without enough pages being freed
+ * into them (map_page is INVALID_INDEX) have to take them from another
+ * region.
+ */
+static void mm_materialise_region(mem_region_t* region, size_t map_page)
+{
+    if(!region->flags.lazy_bitmap)
+        return;
+
+    bool was_free = (region->order_map & (1 << MAX_ORDER)) != 0;
+    unsigned long base = (unsigned long)region->base << BLOCK_SHIFT;
+    unsigned long frames;
+
+    if(was_free)
+        map_page = 0;
+
+    // Hide the region from any allocations done while mapping
+    region_set_order_map(region, 0);
+    region_add_free(region, 0, -(long)region->free_pages);
+
+    if(map_page != INVALID_INDEX)
+    {
+        frames = base + (map_page << BASE_SHIFT);
+        zone_add_run(region, map_page, -(long)BUDDY_MAP_PAGES, true);
+    }
+    else
+    {
+        frames = zone_alloc(BUDDY_MAP_PAGES, MM_ZONE_64BIT, 1, region->flags.node);
+
+        if(frames == (unsigned long)KNULL)
+            kpanic("Out of memory for the buddy maps of region %p", region);
+    }
+
+    struct buddy_map* map = map_buddy_map(frames);
+    memset(map, 0x00, sizeof(struct buddy_map));
+
+    region->bitmap = map;
+    region->flags.lazy_bitmap = 0;
+
+    // Everything after the maps is still free
+    if(was_free)
+        buddy_free_range(region, BUDDY_MAP_PAGES, BLOCK_PAGES - BUDDY_MAP_PAGES);
+}
+
+/*
+ * Creates a region block and appends it to list_tail.
+ * Base to be passed should be base >> 27 (size of region coverage).
+ */
+static mem_region_t* mm_create_region(mem_region_t* list_tail,
+                                      uint64_t base)
+{
+    mem_region_t* append = KNULL;
+    if(++frame_blocks >= 128)
+    {
+        // Map a new pointer list
+        append = get_next_address(1);
+
+        if(frame_blocks % 128 == 0)
+            mmu_map(append, mm_alloc(1), MMU_FLAGS_DEFAULT);
+        frame_blocks = 0;
+    }
+    else
+    {
+        // Keep on using the current structure
+        append = (mem_region_t*)((size_t)list_tail + sizeof(mem_region_t));
+    }
+
+    append->next = KNULL;
+    append->base = base;
+    append->order_map = 0;
+    append->free_pages = 0;
+
+    if(base < zones[MM_ZONE_DMA].end_block)
+        append->flags.type = RTYPE_LOW;
+    else if(base < zones[MM_ZONE_32BIT].end_block)
+        append->flags.type = RTYPE_32BIT;
+    else
+        append->flags.type = RTYPE_64BIT;
+
+    append->flags.node = 0;
+    append->flags.reserved = 0x0;
+    append->flags.present = 0;
+
+    for(size_t i = 0; i < num_node_ranges; i++)
+    {
+        if(base >= node_ranges[i].first_block && base < node_ranges[i].end_block)
+            append->flags.node = node_ranges[i].node;
+    }
+    append->flags.lazy_bitmap = 1;
+    append->bitmap = (struct buddy_map*)LAZY_BITMAP;
+
+    append->flags.present = 1;
+    mm_append_block(list_tail, append);
+    index_insert(append);
+    return append;
+}
+
+/**
+ * @brief  Finds memory area containg the address
+ * @note   
+ * @param  address: The address to find the containing area
+ * @retval The containing area, or NULL if none was found
+ */
+static struct mem_area* find_area(unsigned long address)
+{
+    for(size_t i = 0; i < next_free_area; i++)
+    {
+        struct mem_area* check = &(area_list[i]);
+
+        if(address >= check->base && address < (check->base + check->length))
+            return check;
+    }
+
+    return NULL;
+}
+
+void mm_early_init()
+{
+    // Reserve appropriate regions
+    // Null page
+    mm_add_area(0, 0x1000, TYPE_RESERVED);
+
+    // Kernel region
+    mm_add_area((uintptr_t)&kernel_phystart, (size_t)&kernel_physize, TYPE_RESERVED);
+
+    // Initrd area
+    mm_add_area(initrd_start, initrd_size, TYPE_RESERVED);
+
+    // Setup the bitmap
+    mem_region_t* node = (mem_region_t*)&init_region_list;
+    region_list = node;
+
+    memset(init_region_list, 0, sizeof(init_region_list));
+    memset(&init_region_bitmap, 0x00, sizeof(init_region_bitmap));
+
+    node->next = KNULL;
+    node->base = 0;
+    node->order_map = 0;
+    node->free_pages = 0;
+    node->flags.type = RTYPE_LOW;
+    node->flags.node = 0;
+    node->flags.reserved = 0x00U;
+    node->flags.present = 1;
+    node->flags.lazy_bitmap = 0;
+    node->bitmap = &init_region_bitmap;
+    index_insert(node);
+
+    vmem_create(&mm_arena, "mm", (uintptr_t)mm_get_base(), MMU_SIZE, PAGE_SIZE, 0);
+
+    // Sort the areas so that low memory is available before the buddy maps
+    // of the higher regions need to be allocated
+    for(size_t i = 1; i < next_free_area; i++)
+    {
+        struct mem_area area = area_list[i];
+        size_t j = i;
+
+        for(; j > 0 && area_list[j - 1].base > area.base; j--)
+            area_list[j] = area_list[j - 1];
+
+        area_list[j] = area;
+    }
+
+    klog_logln(LVL_INFO, "Complete list:");
+    for(size_t i = 0; i < next_free_area; i++)
+    {
+        struct mem_area* area = &(area_list[i]);
+
+        if(!area->type)
+            continue;
+        klog_logln(LVL_INFO, "    %08.8p | %08.8p | %01d", area->base, area->length, area->type);
+        mm_add_region(area->base, area->length, area->type);
+    }
+}
+
+/*
+ * Checks if the area is memory which the kernel can use, rather than a
+ * firmware area (which may not be safe to map as write-back)
+ */
+static bool area_in_direct_map(struct mem_area* area)
+{
+    uint64_t end = area->base + area->length;
+
+    if(area->type == TYPE_AVAILABLE || area->type == TYPE_ACPI_RECLAIMABLE)
+        return true;
+
+    if(area->type != TYPE_RESERVED)
+        return false;
+
+    // The kernel image (with the boot page tables) and the initrd
+    if(area->base < (uintptr_t)&kernel_phypage_end && end > (uintptr_t)&kernel_phystart)
+        return true;
+
+    return initrd_start != 0xDEADBEEF && area->base < (uint64_t)initrd_start + initrd_size && end > initrd_start;
+}
+
+void mm_init()
+{
+    // Build the direct map out of every run of memory the kernel uses
+    uint64_t run_base = 0;
+    uint64_t run_end = 0;
+
+    for(size_t i = 0; i < next_free_area; i++)
+    {
+        struct mem_area* area = &(area_list[i]);
+        uint64_t base = area->base & ~0xFFFULL;
+        uint64_t end = (area->base + area->length + 0xFFF) & ~0xFFFULL;
+
+        if(!area_in_direct_map(area))
+            continue;
+
+        if(run_end != 0 && base <= run_end)
+        {
+            // Touches the current run
+            if(end > run_end)
+                run_end = end;
+            continue;
+        }
+
+        if(run_end != 0)
+            mmu_map_direct(run_base, run_end - run_base);
+
+        run_base = base;
+        run_end = end;
+    }
+
+    if(run_end != 0)
+        mmu_map_direct(run_base, run_end - run_base);
+
+    vmem_init();
+    heap_init();
+}
+
+static void add_area(unsigned long base, unsigned long length, uint32_t type)
+{
+    if(next_free_area >= 64)
+        return;
+
+    struct mem_area* area = &(area_list[next_free_area++]);
+    area->base = base;
+    area->length = length;
+    area->type = type;
+
+    klog_logln(LVL_INFO, "      : %08.8p | %08.8p | %01d", base, length, type);
+}
+
+void mm_add_area(unsigned long base, unsigned long length, uint32_t type)
+{
+    klog_logln(LVL_INFO, "Create: %08.8p | %08.8p | %01d", base, length, type);
+
+    // Cut out overlapping regiojn
+    struct mem_area* base_overlap = find_area(base);
+    struct mem_area* limit_overlap = find_area(base + length);
+
+    if(limit_overlap != NULL)
     {
         // A new region will have to be created to deal with the overlap
 
-        // New base at the end of the current region
-        uint64_t new_base = base + length;
-        uint64_t new_len = limit_overlap->length - (new_base - limit_overlap->base);
+        // New base at the end of the current region
+        uint64_t new_base = base + length;
+        uint64_t new_len = limit_overlap->length - (new_base - limit_overlap->base);
+
+        // Add the area and clone the type
+        add_area(new_base, new_len, limit_overlap->type);
+
+        // Change the limit_overlap length to the appropriate length
+        limit_overlap->length = (new_base - limit_overlap->base);
+
+        if(limit_overlap->length == 0)
+            limit_overlap->type = 0;
+    }
+
+    if(base_overlap != NULL)
+    {
+        // Adjust the base side length accordingly
+        base_overlap->length = base - base_overlap->base;
+
+        if(base_overlap->length == 0)
+            base_overlap->type = 0;
+    }
+
+    // Add the actual region last (prevent over-overlapping)
+    add_area(base, length, type);
+}
+
+// Base address & length in bytes
+void mm_add_region(unsigned long base, size_t length, uint32_t type)
+{
+    // Don't make a new block entry for unreclaimable reserved pages
+    if(type != MEM_REGION_AVAILABLE && type != MEM_REGION_RECLAIMABLE)
+        return;
+
+    // Round out to page boundaries
+    uint64_t limit = ((uint64_t)base + length + 0xFFF) & ~0xFFFULL;
+    uint64_t page_addr = base & ~0xFFFULL;
+
+    while(page_addr < limit)
+    {
+        uint64_t block_limit = ((page_addr >> BLOCK_SHIFT) + 1) << BLOCK_SHIFT;
+        if(block_limit > limit)
+            block_limit = limit;
+
+        mem_region_t *node = index_lookup(page_addr);
+
+        if(node == KNULL)
+        {
+            // Alloc new block & ptr (append to tail)
+            mem_region_t *tail = list_get_tail(region_list);
+            node = mm_create_region(tail, page_addr >> BLOCK_SHIFT);
+        }
+
+        // Whole regions stay lazy until they are first split
+        if(type == MEM_REGION_AVAILABLE)
+        {
+            zone_add_run(node,
+                         (page_addr >> BASE_SHIFT) & (BLOCK_PAGES - 1),
+                         (block_limit - page_addr) >> BASE_SHIFT,
+                         true);
+            buddy_free_range(node,
+                             (page_addr >> BASE_SHIFT) & (BLOCK_PAGES - 1),
+                             (block_limit - page_addr) >> BASE_SHIFT);
+        }
+
+        page_addr = block_limit;
+    }
+}
+
+void mm_set_node(uint64_t base, uint64_t length, unsigned int node)
+{
+    if(node >= MM_MAX_NODES || length == 0)
+        return;
+
+    uint64_t first_block = base >> BLOCK_SHIFT;
+    uint64_t end_block = (base + length + (1ULL << BLOCK_SHIFT) - 1) >> BLOCK_SHIFT;
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(num_node_ranges > 0
+    && node_ranges[num_node_ranges - 1].node == node
+    && node_ranges[num_node_ranges - 1].end_block >= first_block
+    && node_ranges[num_node_ranges - 1].first_block <= first_block)
+    {
+        // Extend the previous range
+        if(node_ranges[num_node_ranges - 1].end_block < end_block)
+            node_ranges[num_node_ranges - 1].end_block = end_block;
+    }
+    else if(num_node_ranges < MAX_NODE_RANGES)
+    {
+        node_ranges[num_node_ranges].first_block = first_block;
+        node_ranges[num_node_ranges].end_block = end_block;
+        node_ranges[num_node_ranges].node = node;
+        num_node_ranges++;
+    }
+    else
+    {
+        klog_logln(LVL_WARN, "Too many node ranges, ignoring %p-%p on node %d", base, base + length, node);
+        hal_enable_interrupts(flags);
+        return;
+    }
+
+    if(node >= num_nodes)
+        num_nodes = node + 1;
+    node_order_valid = false;
+
+    // Tag the regions that already exist
+    for(uint64_t block = first_block; block < end_block; block++)
+    {
+        mem_region_t* region = index_lookup(block << BLOCK_SHIFT);
+
+        if(region != KNULL)
+            region->flags.node = node;
+    }
+
+    hal_enable_interrupts(flags);
+}
+
+void mm_set_node_distance(unsigned int from, unsigned int to, uint8_t distance)
+{
+    if(from >= MM_MAX_NODES || to >= MM_MAX_NODES)
+        return;
+
+    node_distance[from][to] = distance;
+    node_order_valid = false;
+}
+
+/*
+ * Allocates a run of pages directly from the buddy maps of the regions
+ * between the first and end blocks.
+ * The run is aligned to align pages, and ends at or below the page limit
+ * within its region.
+ * Returns the physical address of the run, or KNULL if there was no space.
+ */
+static unsigned long region_alloc(size_t size, uint64_t first_block, uint64_t end_block, size_t align, size_t limit)
+{
+    unsigned int order = size_to_order(size);
+
+    // Buddy blocks are naturally aligned, so just use a bigger block
+    if(size_to_order(align) > order)
+        order = size_to_order(align);
+
+    mem_region_t* region = index_find_free(order, first_block, end_block);
+
+    if(region == KNULL)
+        return (unsigned long)KNULL;
+
+    size_t page;
+
+    if(limit < BLOCK_PAGES)
+        page = buddy_alloc_below(region, order, limit);
+    else
+        page = buddy_alloc(region, order);
+
+    if(page == INVALID_INDEX)
+        return (unsigned long)KNULL;
+
+    // Give back the unused tail of the block
+    if((1UL << order) > size)
+        buddy_free_range(region, page + size, (1UL << order) - size);
+
+    return ((unsigned long)region->base << BLOCK_SHIFT) | (page << BASE_SHIFT);
+}
+
+/*
+ * Allocates a run of pages that spans multiple regions between the first and
+ * end blocks. The run starts on a region boundary, and every region covered
+ * by it has to be completely free.
+ * Returns the physical address of the run, or KNULL if there was no space.
+ */
+static unsigned long region_alloc_span(size_t size, uint64_t first_block, uint64_t end_block, size_t align)
+{
+    size_t num_regions = (size + BLOCK_PAGES - 1) / BLOCK_PAGES;
+    uint64_t align_blocks = align > BLOCK_PAGES ? (align / BLOCK_PAGES) : 1;
+    uint64_t start = first_block;
+    mem_region_t* first;
+
+    while((first = index_find_order(MAX_ORDER, start)) != KNULL)
+    {
+        size_t covered = 1;
+
+        if(first->base + num_regions > end_block)
+            return (unsigned long)KNULL;
+
+        if((first->base & (align_blocks - 1)) != 0)
+        {
+            start = (first->base + align_blocks) & ~(align_blocks - 1);
+            continue;
+        }
+
+        // Check that the following regions are adjacent and free
+        for(; covered < num_regions; covered++)
+        {
+            uint64_t next_addr = (uint64_t)(first->base + covered) << BLOCK_SHIFT;
+            mem_region_t* next = index_lookup(next_addr);
+
+            if(next == KNULL || !next->flags.present || !(next->order_map & (1 << MAX_ORDER)))
+                break;
+        }
+
+        if(covered == num_regions)
+            break;
+
+        start = first->base + covered;
+    }
+
+    if(first == KNULL)
+        return (unsigned long)KNULL;
+
+    mem_region_t* region = first;
+
+    for(size_t i = 0; i < num_regions; i++)
+    {
+        region = index_lookup((uint64_t)(first->base + i) << BLOCK_SHIFT);
+        buddy_alloc(region, MAX_ORDER);
+    }
+
+    // Give back the unused tail of the last region
+    size_t tail = num_regions * BLOCK_PAGES - size;
+    if(tail > 0)
+        buddy_free_range(region, BLOCK_PAGES - tail, tail);
+
+    return (unsigned long)first->base << BLOCK_SHIFT;
+}
+
+/*
+ * Checks if an allocation from a higher zone can fall back onto this zone
+ * without eating into the zone's reserve
+ */
+static bool zone_can_fallback(struct mem_zone* zone, size_t size)
+{
+    return zone->free_pages >= size + (zone->total_pages >> ZONE_RESERVE_SHIFT);
+}
+
+static uint8_t get_node_distance(unsigned int from, unsigned int to)
+{
+    if(node_distance[from][to] != 0)
+        return node_distance[from][to];
+
+    return from == to ? NODE_DISTANCE_LOCAL : NODE_DISTANCE_REMOTE;
+}
+
+/*
+ * Sorts the nodes by their distance from every node
+ */
+static void build_node_order()
+{
+    for(unsigned int from = 0; from < num_nodes; from++)
+    {
+        uint8_t* order = node_order[from];
+
+        for(unsigned int i = 0; i < num_nodes; i++)
+        {
+            unsigned int j = i;
+
+            for(; j > 0 && get_node_distance(from, order[j - 1]) > get_node_distance(from, i); j--)
+                order[j] = order[j - 1];
+
+            order[j] = i;
+        }
+    }
+
+    node_order_valid = true;
+}
+
+/*
+ * Allocates a run of pages from the part of the zone between the first and
+ * end blocks
+ * Returns the physical address of the run, or KNULL if there was no space.
+ */
+static unsigned long zone_alloc_range(size_t size, struct mem_zone* zone, size_t align, size_t limit, uint64_t first_block, uint64_t end_block)
+{
+    if(first_block < zone->first_block)
+        first_block = zone->first_block;
+    if(end_block > zone->end_block)
+        end_block = zone->end_block;
+
+    if(first_block >= end_block)
+        return (unsigned long)KNULL;
+
+    if(size > BLOCK_PAGES || align > BLOCK_PAGES)
+        return region_alloc_span(size, first_block, end_block, align);
+    else
+        return region_alloc(size, first_block, end_block, align, limit);
+}
+
+/*
+ * Allocates a run of pages from one of the zones that an allocation from the
+ * given zone may use, keeping the reserve of the zones below it
+ * Returns the physical address of the run, or KNULL if there was no space.
+ */
+static unsigned long zone_alloc_from(size_t size, enum mm_zone zone, int from, size_t align, size_t limit, uint64_t first_block, uint64_t end_block)
+{
+    if(from == (int)zone || zone_can_fallback(&zones[from], size))
+        return zone_alloc_range(size, &zones[from], align, limit, first_block, end_block);
+
+    // The rest of the low region is in the 32-bit zone, so it can still be used
+    if(from != MM_ZONE_DMA || first_block > 0 || end_block == 0 || size > BLOCK_PAGES)
+        return (unsigned long)KNULL;
+
+    mem_region_t* region = index_lookup(0);
+
+    if(region == KNULL)
+        return (unsigned long)KNULL;
+
+    unsigned int order = size_to_order(size);
+
+    if(size_to_order(align) > order)
+        order = size_to_order(align);
+
+    size_t page = buddy_alloc_above(region, order, DMA_LIMIT_PAGES);
+
+    if(page == INVALID_INDEX)
+        return (unsigned long)KNULL;
+
+    if((1UL << order) > size)
+        buddy_free_range(region, page + size, (1UL << order) - size);
+
+    return page << BASE_SHIFT;
+}
+
+/*
+ * Allocates a run of pages from the zone, falling back onto the zones below
+ * it when it runs out. Memory on the given node is used first, and then the
+ * memory on the other nodes from the nearest to the furthest.
+ * Returns the physical address of the run, or KNULL if there was no space.
+ */
+static unsigned long zone_alloc(size_t size, enum mm_zone zone, size_t align, unsigned int node)
+{
+    size_t limit = BLOCK_PAGES;
+    unsigned long frame;
+
+    if(zone == MM_ZONE_DMA)
+    {
+        if(size > DMA_LIMIT_PAGES || align > DMA_LIMIT_PAGES)
+            return (unsigned long)KNULL;
+
+        limit = DMA_LIMIT_PAGES;
+    }
+
+    // Zones without any memory don't need the ones below them to keep a reserve
+    while(zone > MM_ZONE_DMA && zones[zone].total_pages == 0)
+        zone--;
+
+    if(num_node_ranges > 0)
+    {
+        if(!node_order_valid)
+            build_node_order();
+
+        if(node >= num_nodes)
+            node = 0;
+
+        for(unsigned int n = 0; n < num_nodes; n++)
+        {
+            unsigned int candidate = node_order[node][n];
+
+            for(int i = zone; i >= 0; i--)
+            {
+                for(size_t r = 0; r < num_node_ranges; r++)
+                {
+                    struct node_range* range = &node_ranges[r];
+
+                    if(range->node != candidate)
+                        continue;
+
+                    frame = zone_alloc_from(size, zone, i, align, limit, range->first_block, range->end_block);
+
+                    if(frame != (unsigned long)KNULL)
+                        return frame;
+                }
+            }
+        }
+    }
+
+    // Memory outside of any node range, or no node ranges at all
+    for(int i = zone; i >= 0; i--)
+    {
+        frame = zone_alloc_from(size, zone, i, align, limit, 0, ~0ULL);
+
+        if(frame != (unsigned long)KNULL)
+            return frame;
+    }
+
+    return (unsigned long)KNULL;
+}
+
+/*
+ * Returns a run of pages directly to the buddy maps.
+ * The run may cross into the regions after the given one.
+ */
+static void region_free(mem_region_t* region, unsigned long addr, size_t size)
+{
+    while(size > 0)
+    {
+        if(region == KNULL)
+            kpanic("Bad mm_free address (%p, %x)", region, addr);
+
+        size_t frame_ptr = (((size_t)addr) >> BASE_SHIFT) & (BLOCK_PAGES - 1);
+        size_t count = BLOCK_PAGES - frame_ptr;
 
-        // Add the area and clone the type
-        add_area(new_base, new_len, limit_overlap->type);
+        if(count > size)
+            count = size;
 
-        // Change the limit_overlap length to the appropriate length
-        limit_overlap->length = (new_base - limit_overlap->base);
+        buddy_free_range(region, frame_ptr, count);
 
-        if(limit_overlap->length == 0)
-            limit_overlap->type = 0;
+        size -= count;
+        addr += (unsigned long)count << BASE_SHIFT;
+
+        if(size > 0)
+            region = index_lookup(addr);
     }
+}
 
-    if(base_overlap != NULL)
+static struct pcp_cache* pcp_get_cache()
+{
+    // TODO: Index by the current cpu when doing SMP
+    return &pcp_caches[0];
+}
+
+/*
+ * Refills the cache with a batch of frames, preferably from a single block
+ */
+static void pcp_refill(struct pcp_cache* cache, unsigned int node)
+{
+    unsigned long base = zone_alloc(PCP_BATCH, MM_ZONE_64BIT, PCP_BATCH, node);
+
+    if(base != (unsigned long)KNULL)
     {
-        // Adjust the base side length accordingly
-        base_overlap->length = base - base_overlap->base;
+        // Push in reverse so that the lowest frame is handed out first
+        for(size_t i = PCP_BATCH; i > 0; i--)
+            cache->frames[cache->count++] = base + ((i - 1) << BASE_SHIFT);
 
-        if(base_overlap->length == 0)
-            base_overlap->type = 0;
+        return;
     }
 
-    // Add the actual region last (prevent over-overlapping)
-    add_area(base, length, type);
+    // Fragmented, gather the batch one frame at a time
+    while(cache->count < PCP_BATCH)
+    {
+        unsigned long frame = zone_alloc(1, MM_ZONE_64BIT, 1, node);
+
+        if(frame == (unsigned long)KNULL)
+        {
+            // Out of memory, so the zeroed frames are all that is left
+            if(zero_pool.count == 0)
+                break;
+
+            frame = zero_pool.frames[--zero_pool.count];
+        }
+
+        cache->frames[cache->count++] = frame;
+    }
 }
 
-// Base address & length in bytes
-void mm_add_region(unsigned long base, size_t length, uint32_t type)
+/*
+ * Gives up to count of the coldest frames in the cache back to the buddy maps
+ */
+static void pcp_drain(struct pcp_cache* cache, size_t count)
 {
-    mem_region_t *node = list_search_block(region_list, base);
-
-    // Round up length
-    length = ((base & 0xFFF) + length + 0xFFF) & ~0xFFF;
+    if(count > cache->count)
+        count = cache->count;
 
-    // Check if new block is outside of the last block
-    if(node == KNULL || (base >> 27) > (node->base >> 27))
+    for(size_t i = 0; i < count; i++)
     {
-        // Don't make a new block entry for unreclaimable reserved pages
-        if(type != MEM_REGION_AVAILABLE && type != MEM_REGION_RECLAIMABLE)
-            return;
-
-        // Alloc new block & ptr (append to tail)
-        mem_region_t *tail = list_get_tail(region_list);
-        node = mm_create_region(tail, base >> 27);
+        unsigned long frame = cache->frames[i];
+        region_free(index_lookup(frame), frame, 1);
     }
 
-    // Set bits according to type
-    unsigned long page_base = (base >> BASE_SHIFT) & 0x7FFF;
-    unsigned long block_length = length;
+    cache->count -= count;
+    memmove(cache->frames, cache->frames + count, cache->count * sizeof(unsigned long));
+}
+
+/*
+ * Zeroes a frame through the zero window
+ * Interrupts must be disabled
+ */
+static void zero_frame(unsigned long frame)
+{
+    unsigned long* page = mmu_phys_to_virt(frame);
 
-    for(size_t block = 0;;)
+    if(page != KNULL)
     {
-        if(block_length < 0x8000000)
-        {
-            // If less than a full block size, set bits
-            size_t num_pages = (length >> BASE_SHIFT) % 0x8000;
+        for(size_t i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+            page[i] = 0;
+        return;
+    }
 
-            // Exactly 8MiB? Set entire page
-            if(!num_pages)
-                num_pages = 0x8000;
+    if(zero_window == NULL)
+        zero_window = get_next_address(1);
 
-            if(node->flags.lazy_bitmap)
-            {
-                // Allocate a new bitmap
-                node->flags.lazy_bitmap = 0;
-                node->bitmap = get_next_address();
-                mmu_map(node->bitmap, mm_alloc(1), MMU_FLAGS_DEFAULT);
-                memset(node->bitmap, 0xFF, 4096);
-            }
+    page = zero_window;
+    mmu_map(zero_window, frame, MMU_FLAGS_DEFAULT);
 
-            if(type == MEM_REGION_AVAILABLE)
-            {
-                for(size_t bit = 0; bit < num_pages; bit++)
-                    bm_clear_bit(node, bit + page_base);
-            }
+    for(size_t i = 0; i < PAGE_SIZE / sizeof(unsigned long); i++)
+        page[i] = 0;
+
+    mmu_unmap(zero_window, false);
+}
+
+/*
+ * Allocates from the buddy maps, draining the caches if that fails
+ * Interrupts must be disabled
+ */
+static unsigned long mm_alloc_slow(size_t size, enum mm_zone zone, size_t align, unsigned int node)
+{
+    unsigned long frame = zone_alloc(size, zone, align, node);
+
+    if(frame == (unsigned long)KNULL)
+    {
+        // The caches may be holding onto the buddies we need
+        for(size_t i = 0; i < MM_CPU_SLOTS; i++)
+            pcp_drain(&pcp_caches[i], pcp_caches[i].count);
+
+        while(zero_pool.count > 0)
+        {
+            unsigned long zeroed = zero_pool.frames[--zero_pool.count];
+            region_free(index_lookup(zeroed), zeroed, 1);
         }
 
-        if(++block >= (length >> BLOCK_SHIFT))
-            break;
+        frame = zone_alloc(size, zone, align, node);
+    }
 
-        // Alloc new block & ptr
-        mem_region_t *tail = list_get_tail(region_list);
-        node = mm_create_region(tail, (base >> BLOCK_SHIFT) + block);
+    return frame;
+}
 
-        // Starting from a new block, so use no page offset
-        page_base = 0;
-        block_length -= 0x8000000;
+/*
+ * Updates the allocation counters
+ * Interrupts must be disabled
+ */
+static void count_alloc(unsigned long frame, size_t size)
+{
+    if(frame == (unsigned long)KNULL)
+    {
+        mm_counters.alloc_failures++;
+        return;
     }
+
+    mm_counters.alloc_count++;
+    mm_counters.alloc_pages += size;
 }
 
 /*
- * Finds a free memory block with the specified size.
- * Size is in 4KiB blocks.
+ * Finds a free memory block with the specified size on the current cpu's node,
+ * preferring high memory.
+ * Size is in 4KiB blocks. Blocks larger than 128MiB start on a 128MiB boundary.
  * Returns a pointer which matches the criteria, or KNULL if none was found.
  */
 unsigned long mm_alloc(size_t size)
 {
-    size_t bit_index = 0xFFFF;
-    mem_region_t* region = list_search_free(region_list);
+    return mm_alloc_node(size, hal_get_cpu_node());
+}
+
+/*
+ * Finds a free memory block with the specified size, preferring memory on the
+ * given node.
+ * Returns a pointer which matches the criteria, or KNULL if none was found.
+ */
+unsigned long mm_alloc_node(size_t size, unsigned int node)
+{
+    unsigned long frame = (unsigned long)KNULL;
+
+    if(size == 0)
+        return (unsigned long)KNULL;
+
+    cpu_flags_t flags = hal_disable_interrupts();
 
-    if(size >= 32768)
+    if(size == 1 && node == hal_get_cpu_node())
     {
-        // TODO: Are allocations larger than 128MiB needed?
+        // Fast path: Pop a hot frame off of the cache
+        struct pcp_cache* cache = pcp_get_cache();
+
+        if(cache->count == 0)
+            pcp_refill(cache, node);
+
+        if(cache->count > 0)
+            frame = cache->frames[--cache->count];
+    }
+    else
+    {
+        frame = mm_alloc_slow(size, MM_ZONE_64BIT, 1, node);
+    }
+
+    count_alloc(frame, size);
+    hal_enable_interrupts(flags);
+
+    // Check if a block was actually found
+    if(frame == (unsigned long)KNULL)
+        kpanic("Out of Memory");
+
+    return frame;
+}
+
+/*
+ * Finds a free memory block within the zone, or the zones below it
+ * Size and alignment are in 4KiB blocks, and the alignment must be a power of 2
+ * Returns a pointer which matches the criteria, or KNULL if none was found.
+ */
+unsigned long mm_alloc_zone(size_t size, enum mm_zone zone, size_t align)
+{
+    if(size == 0 || zone >= MM_ZONE_COUNT || (align & (align - 1)) != 0)
+        return (unsigned long)KNULL;
+
+    if(align == 0)
+        align = 1;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    unsigned long frame = mm_alloc_slow(size, zone, align, hal_get_cpu_node());
+    count_alloc(frame, size);
+    hal_enable_interrupts(flags);
+
+    return frame;
+}
+
+/*
+ * Finds a free memory block with the specified size, with all of it zeroed.
+ * Single frames come out of the pool zeroed while idle, and everything else
+ * gets zeroed on the spot.
+ * Returns a pointer which matches the criteria, or KNULL if none was found.
+ */
+unsigned long mm_alloc_zeroed(size_t size)
+{
+    unsigned long frame = (unsigned long)KNULL;
+
+    if(size == 0)
         return (unsigned long)KNULL;
-    } else
+
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(size == 1 && zero_pool.count > 0)
     {
-        // Find index
-        while(region != KNULL)
-        {
-            bit_index = bm_find_free_bits(region, size);
-            if(bit_index != 0xFFFF) break;
-            region = list_search_free(region->next);
-        }
+        frame = zero_pool.frames[--zero_pool.count];
+        count_alloc(frame, size);
+    }
 
-        // Check if a block was actually found
-        if(region == KNULL && bit_index == 0xFFFF)
-        {
-            kpanic("Out of Memory");
-            return (unsigned long)KNULL;
-        }
+    hal_enable_interrupts(flags);
+
+    if(frame != (unsigned long)KNULL)
+        return frame;
+
+    frame = mm_alloc(size);
+
+    for(size_t i = 0; i < size; i++)
+    {
+        // Let interrupts in between frames
+        flags = hal_disable_interrupts();
+        zero_frame(frame + (i << BASE_SHIFT));
+        hal_enable_interrupts(flags);
+    }
 
-        // Set bits in bitmap
-        for(size_t i = 0; i < size; i++)
-            bm_set_bit(region, bit_index + i);
+    return frame;
+}
+
+/*
+ * Zeroes a single frame into the zeroed frame pool
+ * Returns true if a frame was added, false if the pool is full or there is no
+ * free memory left
+ */
+bool mm_zero_pool_refill()
+{
+    bool refilled = false;
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(zero_pool.count < ZERO_POOL_HIGH)
+    {
+        // Take frames directly from the buddy maps, leaving the hot ones alone
+        unsigned long frame = zone_alloc(1, MM_ZONE_64BIT, 1, hal_get_cpu_node());
 
-        return (region->base << 27) | (bit_index << 12);
+        if(frame != (unsigned long)KNULL)
+        {
+            zero_frame(frame);
+            zero_pool.frames[zero_pool.count++] = frame;
+            refilled = true;
+        }
     }
+
+    hal_enable_interrupts(flags);
+    return refilled;
 }
 
 /*
@@ -576,14 +1795,290 @@ unsigned long mm_alloc(size_t size)
  */
 void mm_free(unsigned long addr, size_t size)
 {
-    if(addr == (unsigned long)KNULL || size == 0 || size >= 32768) return;
+    if(addr == (unsigned long)KNULL || addr == 0 || size == 0) return;
 
-    mem_region_t* region = list_search_block(region_list, (size_t)addr);
+    mem_region_t* region = index_lookup(addr);
     if(region == KNULL)
         return; // None of the mappings contain this address
 
-    size_t frame_ptr = (((size_t)addr) >> 12) & 0x7FFF;
+    cpu_flags_t flags = hal_disable_interrupts();
 
-    for(size_t i = 0; i < size; i++)
-        bm_clear_bit(region, frame_ptr + i);
+    if(size == 1)
+    {
+        // Shared frames are only freed by their last owner
+        uint16_t* share_count = get_share_count(addr, false);
+
+        if(share_count != NULL && *share_count > 0)
+        {
+            (*share_count)--;
+            hal_enable_interrupts(flags);
+            return;
+        }
+
+        // Fast path: Push the frame onto the hot end of the cache
+        struct pcp_cache* cache = pcp_get_cache();
+        unsigned long frame = addr & ~0xFFFUL;
+        size_t page = (frame >> BASE_SHIFT) & (BLOCK_PAGES - 1);
+
+        // Cached frames are still allocated in the buddy maps, so catch double frees here
+        if(buddy_page_free(region, page))
+            kpanic("Double mm_free (%p, %x)", region, page);
+
+        for(size_t i = 0; i < cache->count; i++)
+        {
+            if(cache->frames[i] == frame)
+                kpanic("Double mm_free (%p, %x)", region, page);
+        }
+
+        for(size_t i = 0; i < zero_pool.count; i++)
+        {
+            if(zero_pool.frames[i] == frame)
+                kpanic("Double mm_free (%p, %x)", region, page);
+        }
+
+        if(cache->count >= PCP_HIGH)
+            pcp_drain(cache, PCP_BATCH);
+
+        cache->frames[cache->count++] = frame;
+    }
+    else
+    {
+        region_free(region, addr, size);
+    }
+
+    mm_counters.free_count++;
+    mm_counters.freed_pages += size;
+    hal_enable_interrupts(flags);
+}
+
+void mm_ref(unsigned long frame)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+    uint16_t* share_count = get_share_count(frame, true);
+
+    if(share_count != NULL)
+    {
+        if(*share_count == UINT16_MAX)
+            kpanic("Too many owners of frame %p", frame);
+
+        (*share_count)++;
+    }
+
+    hal_enable_interrupts(flags);
+}
+
+size_t mm_get_refs(unsigned long frame)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+    uint16_t* share_count = get_share_count(frame, false);
+    size_t owners = 1;
+
+    if(share_count != NULL)
+        owners += *share_count;
+
+    hal_enable_interrupts(flags);
+    return owners;
+}
+
+/*
+ * Frees a run of reclaimed frames, and adds them to their zones
+ */
+static void reclaim_run(unsigned long base, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        unsigned long frame = base + (i << BASE_SHIFT);
+        mem_region_t* region = index_lookup(frame);
+
+        if(region != KNULL)
+            zone_add_run(region, (frame >> BASE_SHIFT) & (BLOCK_PAGES - 1), 1, true);
+    }
+
+    region_free(index_lookup(base), base, count);
+}
+
+/*
+ * Records part of a reclaimed area as kept or released. The first part takes
+ * over the area's own entry, and every part after it gets a new entry.
+ */
+static void reclaim_split_area(struct mem_area** entry, unsigned long base, unsigned long length, uint32_t type)
+{
+    if(*entry == NULL)
+    {
+        add_area(base, length, type);
+        return;
+    }
+
+    (*entry)->base = base;
+    (*entry)->length = length;
+    (*entry)->type = type;
+    *entry = NULL;
+}
+
+size_t mm_reclaim(bool (*in_use)(unsigned long frame))
+{
+    size_t released = 0;
+
+    for(size_t i = 0; i < next_free_area; i++)
+    {
+        struct mem_area* area = &(area_list[i]);
+
+        if(area->type != TYPE_ACPI_RECLAIMABLE)
+            continue;
+
+        // Only take the pages that are entirely within the area
+        unsigned long frame = PAGE_ROUNDUP(area->base);
+        unsigned long limit = (area->base + area->length) & ~0xFFFUL;
+        unsigned long run_base = frame;
+        size_t run_length = 0;
+
+        // Frames that were kept stay reserved for good
+        struct mem_area* entry = area;
+        unsigned long area_end = area->base + area->length;
+        unsigned long kept_base = area->base;
+
+        cpu_flags_t flags = hal_disable_interrupts();
+
+        for(; frame <= limit; frame += PAGE_SIZE)
+        {
+            if(frame < limit && index_lookup(frame) != KNULL && (in_use == NULL || !in_use(frame)))
+            {
+                if(run_length == 0)
+                    run_base = frame;
+
+                run_length++;
+                continue;
+            }
+
+            if(run_length == 0)
+                continue;
+
+            reclaim_run(run_base, run_length);
+
+            if(run_base > kept_base)
+                reclaim_split_area(&entry, kept_base, run_base - kept_base, TYPE_RESERVED);
+
+            reclaim_split_area(&entry, run_base, run_length << BASE_SHIFT, TYPE_AVAILABLE);
+            kept_base = run_base + (run_length << BASE_SHIFT);
+
+            released += run_length;
+            run_length = 0;
+        }
+
+        if(kept_base < area_end)
+            reclaim_split_area(&entry, kept_base, area_end - kept_base, TYPE_RESERVED);
+
+        hal_enable_interrupts(flags);
+    }
+
+    return released;
+}
+
+/*
+ * Gets the number of pages in the largest free block of the region
+ */
+static size_t region_largest_free(mem_region_t* region)
+{
+    if(region->order_map == 0)
+        return 0;
+
+    return 1UL << (31 - __builtin_clz(region->order_map));
+}
+
+static void region_to_stats(mem_region_t* region, struct mm_region_stats* stats)
+{
+    stats->base = (uint64_t)region->base << BLOCK_SHIFT;
+    stats->free_pages = region->free_pages;
+    stats->largest_free = region_largest_free(region);
+    stats->zone = region->flags.type;
+    stats->node = region->flags.node;
+    stats->lazy = region->flags.lazy_bitmap;
+}
+
+void mm_get_stats(struct mm_stats* stats)
+{
+    memset(stats, 0, sizeof(struct mm_stats));
+
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    stats->alloc_count = mm_counters.alloc_count;
+    stats->free_count = mm_counters.free_count;
+    stats->alloc_pages = mm_counters.alloc_pages;
+    stats->freed_pages = mm_counters.freed_pages;
+    stats->alloc_failures = mm_counters.alloc_failures;
+
+    for(size_t i = 0; i < MM_ZONE_COUNT; i++)
+    {
+        stats->zones[i].total_pages = zones[i].total_pages;
+        stats->zones[i].free_pages = zones[i].free_pages;
+        stats->total_pages += zones[i].total_pages;
+        stats->free_pages += zones[i].free_pages;
+    }
+
+    for(size_t i = 0; i < MM_CPU_SLOTS; i++)
+        stats->cached_pages += pcp_caches[i].count;
+    stats->cached_pages += zero_pool.count;
+
+    // Runs of completely free regions can be allocated as one
+    uint64_t last_block = 0;
+    size_t free_run = 0;
+
+    for(mem_region_t* region = region_list; region != KNULL; region = region->next)
+    {
+        struct mm_zone_stats* zone = &stats->zones[region->flags.type];
+        size_t largest = region_largest_free(region);
+
+        if(largest == BLOCK_PAGES)
+        {
+            if(free_run == 0 || region->base != last_block + 1)
+                free_run = 0;
+
+            free_run += BLOCK_PAGES;
+            last_block = region->base;
+
+            if(free_run > largest)
+                largest = free_run;
+        }
+        else
+        {
+            free_run = 0;
+        }
+
+        if(largest > zone->largest_free)
+            zone->largest_free = largest;
+        if(largest > stats->largest_free)
+            stats->largest_free = largest;
+    }
+
+    hal_enable_interrupts(flags);
+
+    for(size_t i = 0; i < next_free_area; i++)
+    {
+        struct mem_area* area = &(area_list[i]);
+
+        if(area->type != TYPE_IGNORE && area->type != TYPE_AVAILABLE)
+            stats->reserved_pages += PAGE_ROUNDUP(area->length) >> BASE_SHIFT;
+    }
+}
+
+void mm_get_counters(struct mm_counters* counters)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+    *counters = mm_counters;
+    hal_enable_interrupts(flags);
+}
+
+void* mm_next_region_stats(void* region, struct mm_region_stats* stats)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+    mem_region_t* next = region == NULL ? region_list : ((mem_region_t*)region)->next;
+
+    // Regions are never removed, so the list can be walked across calls
+    if(next != KNULL)
+        region_to_stats(next, stats);
+    else
+        next = NULL;
+
+    hal_enable_interrupts(flags);
+    return next;
 }
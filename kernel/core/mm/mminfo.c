@@ -0,0 +1,137 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ * 
+ * This file is part of Kernel4.
+ * 
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#include <string.h>
+
+#include <common/hal.h>
+#include <common/hal/timer.h>
+#include <common/mm/mm.h>
+#include <common/util/kfuncs.h>
+
+#define SAMPLE_PERIOD 1000000000ULL     // Rates are taken every second
+
+static const char* zone_names[MM_ZONE_COUNT] = { "DMA", "32-bit", "64-bit" };
+
+// Counters at the last sample, and the rates up to it
+static struct
+{
+    uint64_t time;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t alloc_rate;
+    uint64_t free_rate;
+} sample;
+
+/*
+ * Gets the per second rate of a counter
+ */
+static uint64_t get_rate(uint64_t count, uint64_t last_count, uint64_t elapsed)
+{
+    if(elapsed == 0)
+        return 0;
+
+    return ((count - last_count) * 1000000000ULL) / elapsed;
+}
+
+/*
+ * Samples the counters once every period, so that every reader sees the same
+ * rates no matter how often they look
+ */
+static void mm_info_sample(struct timer_dev* dev)
+{
+    uint64_t elapsed = dev->counter - sample.time;
+
+    if(elapsed < SAMPLE_PERIOD)
+        return;
+
+    struct mm_counters counters;
+    mm_get_counters(&counters);
+
+    sample.alloc_rate = get_rate(counters.alloc_count, sample.alloc_count, elapsed);
+    sample.free_rate = get_rate(counters.free_count, sample.free_count, elapsed);
+    sample.time = dev->counter;
+    sample.alloc_count = counters.alloc_count;
+    sample.free_count = counters.free_count;
+}
+
+void mm_info_init()
+{
+    sample.time = timer_read_counter(0);
+    timer_add_handler(0, mm_info_sample);
+}
+
+size_t mm_format_info(char* buffer, size_t length, bool regions)
+{
+    struct mm_stats stats;
+    size_t index = 0;
+
+    if(length == 0)
+        return 0;
+
+    mm_get_stats(&stats);
+
+    // The sample is updated from the timer
+    cpu_flags_t flags = hal_disable_interrupts();
+    uint64_t alloc_rate = sample.alloc_rate;
+    uint64_t free_rate = sample.free_rate;
+    hal_enable_interrupts(flags);
+
+    uint64_t used_pages = stats.total_pages - stats.free_pages - stats.cached_pages;
+
+    index = kappendf(buffer, length, index, "Total:     %8lu KiB\n", (unsigned long)(stats.total_pages << 2));
+    index = kappendf(buffer, length, index, "Free:      %8lu KiB\n", (unsigned long)(stats.free_pages << 2));
+    index = kappendf(buffer, length, index, "Cached:    %8lu KiB\n", (unsigned long)(stats.cached_pages << 2));
+    index = kappendf(buffer, length, index, "Used:      %8lu KiB\n", (unsigned long)(used_pages << 2));
+    index = kappendf(buffer, length, index, "Reserved:  %8lu KiB\n", (unsigned long)(stats.reserved_pages << 2));
+    index = kappendf(buffer, length, index, "Largest:   %8lu KiB\n", (unsigned long)(stats.largest_free << 2));
+    index = kappendf(buffer, length, index, "Allocs:    %8llu (%llu/s, %llu pages)\n",
+                     stats.alloc_count, alloc_rate, stats.alloc_pages);
+    index = kappendf(buffer, length, index, "Frees:     %8llu (%llu/s, %llu pages)\n",
+                     stats.free_count, free_rate, stats.freed_pages);
+    index = kappendf(buffer, length, index, "Failures:  %8llu\n", stats.alloc_failures);
+
+    for(size_t i = 0; i < MM_ZONE_COUNT; i++)
+    {
+        index = kappendf(buffer, length, index, "Zone %-6s total %8lu KiB, free %8lu KiB, largest %8lu KiB\n",
+                         zone_names[i],
+                         (unsigned long)(stats.zones[i].total_pages << 2),
+                         (unsigned long)(stats.zones[i].free_pages << 2),
+                         (unsigned long)(stats.zones[i].largest_free << 2));
+    }
+
+    if(regions)
+    {
+        struct mm_region_stats region;
+        void* cursor = NULL;
+
+        while((cursor = mm_next_region_stats(cursor, &region)) != NULL)
+        {
+            index = kappendf(buffer, length, index, "Region %016llx: %-6s node %u, free %6lu KiB, largest %6lu KiB%s\n",
+                             region.base,
+                             zone_names[region.zone],
+                             region.node,
+                             (unsigned long)(region.free_pages << 2),
+                             (unsigned long)(region.largest_free << 2),
+                             region.lazy ? " (lazy)" : "");
+        }
+    }
+
+    return index;
+}
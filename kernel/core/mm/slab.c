@@ -0,0 +1,312 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <common/hal.h>
+#include <common/mm/mm.h>
+#include <common/mm/slab.h>
+#include <common/mm/vmem.h>
+#include <common/util/kfuncs.h>
+
+#define SLAB_MIN_OBJECTS    8                   // Slabs are grown until they fit this many objects
+#define SLAB_MAX_SIZE       (PAGE_SIZE * 16)
+#define SLAB_MAX_OBJECTS    0xFFFF
+
+/**
+ * A run of objects, with this header at its base
+ * Free objects are tracked by index, so that the objects keep their
+ * constructed state while they are free
+ */
+struct kmem_slab
+{
+    struct kmem_slab* prev;
+    struct kmem_slab* next;
+    kmem_cache_t* cache;
+    uint8_t* objects;
+    bool direct;                // The slab is in the direct map, instead of the io arena
+    uint16_t in_use;
+    uint16_t free_count;
+    uint16_t free_stack[];      // Indices of the free objects
+};
+
+static kmem_cache_t* cache_list = NULL;
+
+static void slab_list_remove(struct kmem_slab** head, struct kmem_slab* slab)
+{
+    if(slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        *head = slab->next;
+
+    if(slab->next != NULL)
+        slab->next->prev = slab->prev;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+static void slab_list_push(struct kmem_slab** head, struct kmem_slab* slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+
+    if(*head != NULL)
+        (*head)->prev = slab;
+
+    *head = slab;
+}
+
+/*
+ * Gets the offset of the first object in a slab holding the given number of objects
+ */
+static size_t objects_offset(kmem_cache_t* cache, size_t objects)
+{
+    size_t header = sizeof(struct kmem_slab) + objects * sizeof(uint16_t);
+    return (header + cache->align - 1) & ~(cache->align - 1);
+}
+
+/*
+ * Sizes up the slabs of a cache, and adds it to the cache list
+ */
+static void cache_setup(kmem_cache_t* cache)
+{
+    if(cache->align == 0)
+        cache->align = sizeof(uintptr_t);
+
+    if(cache->align & (cache->align - 1))
+        kpanic("slab: Alignment of cache %s isn't a power of two", cache->name);
+
+    cache->object_size = (cache->object_size + cache->align - 1) & ~(cache->align - 1);
+
+    // Grow the slabs until enough objects fit, so that little space is wasted
+    for(cache->slab_size = PAGE_SIZE; cache->slab_size <= SLAB_MAX_SIZE; cache->slab_size <<= 1)
+    {
+        size_t objects = (cache->slab_size - sizeof(struct kmem_slab)) / (cache->object_size + sizeof(uint16_t));
+
+        if(objects > SLAB_MAX_OBJECTS)
+            objects = SLAB_MAX_OBJECTS;
+
+        while(objects > 0 && objects_offset(cache, objects) + objects * cache->object_size > cache->slab_size)
+            objects--;
+
+        cache->slab_objects = objects;
+
+        if(objects >= SLAB_MIN_OBJECTS || cache->slab_size == SLAB_MAX_SIZE)
+            break;
+    }
+
+    if(cache->slab_objects == 0)
+        kpanic("slab: Objects of cache %s are too large (%lu bytes)", cache->name, (unsigned long)cache->object_size);
+
+    cache->next = cache_list;
+    cache_list = cache;
+    cache->listed = true;
+}
+
+static struct kmem_slab* slab_create(kmem_cache_t* cache)
+{
+    struct kmem_slab* slab = KNULL;
+    bool direct = false;
+
+    if(cache->slab_size == PAGE_SIZE)
+    {
+        unsigned long frame = mm_alloc(1);
+        slab = mmu_phys_to_virt(frame);
+
+        if(slab != KNULL)
+        {
+            direct = true;
+        }
+        else
+        {
+            slab = vmem_alloc(&io_arena, PAGE_SIZE);
+
+            if(slab == KNULL)
+                kpanic("slab: Out of address space for cache %s", cache->name);
+
+            mmu_map(slab, frame, MMU_FLAGS_DEFAULT);
+        }
+    }
+    else
+    {
+        // Slabs are aligned to their size, so that objects can find their slab
+        slab = vmem_xalloc(&io_arena, cache->slab_size, cache->slab_size);
+
+        if(slab == KNULL)
+            kpanic("slab: Out of address space for cache %s", cache->name);
+
+        for(size_t offset = 0; offset < cache->slab_size; offset += PAGE_SIZE)
+            mmu_map((uint8_t*)slab + offset, mm_alloc(1), MMU_FLAGS_DEFAULT);
+    }
+
+    slab->prev = NULL;
+    slab->next = NULL;
+    slab->cache = cache;
+    slab->objects = (uint8_t*)slab + objects_offset(cache, cache->slab_objects);
+    slab->direct = direct;
+    slab->in_use = 0;
+    slab->free_count = cache->slab_objects;
+
+    // Hand out the lowest objects first
+    for(size_t i = 0; i < cache->slab_objects; i++)
+    {
+        slab->free_stack[i] = cache->slab_objects - i - 1;
+
+        if(cache->ctor != NULL)
+            cache->ctor(slab->objects + i * cache->object_size);
+    }
+
+    cache->total_objects += cache->slab_objects;
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, struct kmem_slab* slab)
+{
+    bool direct = slab->direct;
+
+    cache->total_objects -= cache->slab_objects;
+    cache->slab_count--;
+
+    for(size_t offset = 0; offset < cache->slab_size; offset += PAGE_SIZE)
+        mm_free(mmu_get_mapping((uint8_t*)slab + offset), 1);
+
+    if(!direct)
+    {
+        mmu_unmap_range(slab, cache->slab_size, true);
+        vmem_free(&io_arena, slab, cache->slab_size);
+    }
+}
+
+void kmem_cache_create(kmem_cache_t* cache, const char* name, size_t size, size_t align, kmem_ctor_t ctor)
+{
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(!cache->listed)
+        cache_setup(cache);
+
+    struct kmem_slab* slab = cache->partial;
+
+    if(slab == NULL)
+    {
+        // Reuse the empty slab before making a new one
+        if(cache->empty != NULL)
+        {
+            slab = cache->empty;
+            slab_list_remove(&cache->empty, slab);
+        }
+        else
+        {
+            slab = slab_create(cache);
+        }
+
+        slab_list_push(&cache->partial, slab);
+    }
+
+    uint16_t object_index = slab->free_stack[--slab->free_count];
+    slab->in_use++;
+
+    if(slab->free_count == 0)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->alloc_count++;
+    cache->active_objects++;
+
+    hal_enable_interrupts(flags);
+    return slab->objects + object_index * cache->object_size;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object)
+{
+    if(object == NULL || object == KNULL)
+        return;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    struct kmem_slab* slab = (struct kmem_slab*)((uintptr_t)object & ~(cache->slab_size - 1));
+
+    if(!cache->listed || slab->cache != cache)
+        kpanic("slab: Object %p doesn't belong to cache %s", object, cache->name);
+
+    if(slab->free_count == 0)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    slab->free_stack[slab->free_count++] = ((uint8_t*)object - slab->objects) / cache->object_size;
+    slab->in_use--;
+
+    cache->free_count++;
+    cache->active_objects--;
+
+    if(slab->in_use == 0)
+    {
+        // Keep one empty slab around, so that alloc/free pairs don't churn slabs
+        slab_list_remove(&cache->partial, slab);
+
+        if(cache->empty == NULL)
+            slab_list_push(&cache->empty, slab);
+        else
+            slab_destroy(cache, slab);
+    }
+
+    hal_enable_interrupts(flags);
+}
+
+size_t kmem_format_info(char* buffer, size_t length)
+{
+    size_t index = 0;
+
+    if(length == 0)
+        return 0;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    index = kappendf(buffer, length, index, "%-20s %8s %8s %6s %6s %10s %10s\n", "Cache", "Active", "Total", "Size", "Slabs", "Allocs", "Frees");
+
+    for(kmem_cache_t* cache = cache_list; cache != NULL; cache = cache->next)
+    {
+        index = kappendf(buffer, length, index, "%-20s %8lu %8lu %6lu %6lu %10lu %10lu\n",
+                         cache->name,
+                         (unsigned long)cache->active_objects,
+                         (unsigned long)cache->total_objects,
+                         (unsigned long)cache->object_size,
+                         (unsigned long)cache->slab_count,
+                         (unsigned long)cache->alloc_count,
+                         (unsigned long)cache->free_count);
+    }
+
+    hal_enable_interrupts(flags);
+
+    return index;
+}
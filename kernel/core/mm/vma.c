@@ -0,0 +1,347 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <common/hal.h>
+#include <common/mm/liballoc.h>
+#include <common/mm/mm.h>
+#include <common/mm/vma.h>
+#include <common/sched/sched.h>
+
+#define SHARE_BATCH 32  // Pages shared per switch into the child's address space
+
+// Holds a page being copied, if there isn't a direct map to copy through
+static uint8_t copy_buffer[PAGE_SIZE];
+
+/*
+ * Splits an area in two at the address, if the address is inside of it
+ */
+static void area_split(struct vm_area* area, uintptr_t at)
+{
+    if(at <= area->base || at >= area->end)
+        return;
+
+    struct vm_area* tail = kmalloc(sizeof(struct vm_area));
+    tail->base = at;
+    tail->end = area->end;
+    tail->flags = area->flags;
+    tail->next = area->next;
+
+    area->end = at;
+    area->next = tail;
+}
+
+/*
+ * Frees every page that was faulted in, and unmaps the range
+ */
+static void area_free_pages(struct vm_area* area)
+{
+    uintptr_t page = area->base;
+
+    // Only the pages that were faulted in are visited
+    while((page = (uintptr_t)mmu_next_mapped((void*)page, (void*)area->end)) < area->end)
+    {
+        mm_free(mmu_get_mapping((void*)page), 1);
+        page += PAGE_SIZE;
+    }
+
+    mmu_unmap_range((void*)area->base, area->end - area->base, true);
+}
+
+/*
+ * Shares every page that was faulted in with the child, read-only
+ */
+static void area_share_pages(struct vm_area* area, process_t* child)
+{
+    uintptr_t pages[SHARE_BATCH];
+    unsigned long frames[SHARE_BATCH];
+    uint32_t shared_flags = area->flags & ~MMU_ACCESS_W;
+    uintptr_t page = area->base;
+
+    while(page < area->end)
+    {
+        size_t count = 0;
+
+        for(; count < SHARE_BATCH; page += PAGE_SIZE)
+        {
+            page = (uintptr_t)mmu_next_mapped((void*)page, (void*)area->end);
+
+            if(page >= area->end)
+                break;
+
+            pages[count] = page;
+            frames[count] = mmu_get_mapping((void*)page);
+            mm_ref(frames[count]);
+            count++;
+        }
+
+        if(count == 0)
+            continue;
+
+        mmu_set_temp_context(child->page_context_base);
+        for(size_t i = 0; i < count; i++)
+            mmu_map((void*)pages[i], frames[i], shared_flags);
+        mmu_exit_temp_context();
+    }
+
+    // Writes from either side now fault, breaking the sharing
+    if(area->flags & MMU_ACCESS_W)
+        mmu_protect_range((void*)area->base, area->end - area->base, shared_flags);
+}
+
+/*
+ * Gives the address space its own copy of a shared page
+ */
+static bool area_unshare_page(struct vm_area* area, void* page)
+{
+    unsigned long frame = mmu_get_mapping(page);
+
+    // The other owners are gone, so the page can be written to directly
+    if(mm_get_refs(frame) <= 1)
+        return mmu_change_attr(page, area->flags) == 0;
+
+    unsigned long copy = mm_alloc(1);
+    void* copy_page = mmu_phys_to_virt(copy);
+
+    if(copy_page != KNULL)
+        memcpy(copy_page, page, PAGE_SIZE);
+    else
+        memcpy(copy_buffer, page, PAGE_SIZE);
+
+    mmu_unmap(page, false);
+    mmu_map(page, copy, area->flags);
+
+    if(copy_page == KNULL)
+        memcpy(page, copy_buffer, PAGE_SIZE);
+
+    // Drop this address space's ownership of the shared frame
+    mm_free(frame, 1);
+    return true;
+}
+
+int vma_reserve(process_t* process, void* address, size_t size, uint32_t flags)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    if(process == KNULL || size == 0 || end <= base)
+        return MMU_MAPPING_INVAL;
+
+    cpu_flags_t cpu_flags = hal_disable_interrupts();
+    struct vm_area** link = &process->vm_areas;
+
+    // Keep the areas in address order
+    while(*link != NULL && (*link)->end <= base)
+        link = &(*link)->next;
+
+    if(*link != NULL && (*link)->base < end)
+    {
+        hal_enable_interrupts(cpu_flags);
+        return MMU_MAPPING_EXISTS;
+    }
+
+    struct vm_area* area = kmalloc(sizeof(struct vm_area));
+    area->base = base;
+    area->end = end;
+    area->flags = flags;
+    area->next = *link;
+    *link = area;
+
+    hal_enable_interrupts(cpu_flags);
+    return 0;
+}
+
+void vma_release(process_t* process, void* address, size_t size)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    if(process == KNULL)
+        return;
+
+    cpu_flags_t cpu_flags = hal_disable_interrupts();
+    struct vm_area** link = &process->vm_areas;
+
+    while(*link != NULL && (*link)->base < end)
+    {
+        struct vm_area* area = *link;
+
+        // Keep the parts outside of the range
+        area_split(area, base);
+        if(area->end <= base)
+        {
+            link = &area->next;
+            continue;
+        }
+
+        area_split(area, end);
+
+        area_free_pages(area);
+        *link = area->next;
+        kfree(area);
+    }
+
+    hal_enable_interrupts(cpu_flags);
+}
+
+int vma_protect(process_t* process, void* address, size_t size, uint32_t flags)
+{
+    uintptr_t base = (uintptr_t)address & ~PAGE_MASK;
+    uintptr_t end = PAGE_ROUNDUP((uintptr_t)address + size);
+
+    if(process == KNULL)
+        return MMU_MAPPING_INVAL;
+
+    cpu_flags_t cpu_flags = hal_disable_interrupts();
+
+    for(struct vm_area* area = process->vm_areas; area != NULL && area->base < end; area = area->next)
+    {
+        area_split(area, base);
+        if(area->end <= base)
+            continue;
+
+        area_split(area, end);
+
+        // Areas that haven't been touched don't have any page tables yet
+        if(mmu_protect_range((void*)area->base, area->end - area->base, flags & ~MMU_ACCESS_W) == MMU_MAPPING_NOT_CAPABLE)
+        {
+            hal_enable_interrupts(cpu_flags);
+            return MMU_MAPPING_NOT_CAPABLE;
+        }
+
+        area->flags = flags;
+
+        // Shared pages stay read-only, so that writing to them still copies them
+        if(flags & MMU_ACCESS_W)
+        {
+            uintptr_t page = area->base;
+
+            while((page = (uintptr_t)mmu_next_mapped((void*)page, (void*)area->end)) < area->end)
+            {
+                if(mm_get_refs(mmu_get_mapping((void*)page)) <= 1)
+                    mmu_change_attr((void*)page, flags);
+
+                page += PAGE_SIZE;
+            }
+        }
+    }
+
+    hal_enable_interrupts(cpu_flags);
+    return 0;
+}
+
+struct vm_area* vma_find(process_t* process, void* address)
+{
+    uintptr_t addr = (uintptr_t)address;
+
+    for(struct vm_area* area = process->vm_areas; area != NULL && area->base <= addr; area = area->next)
+    {
+        if(addr < area->end)
+            return area;
+    }
+
+    return NULL;
+}
+
+int vma_fork(process_t* parent, process_t* child)
+{
+    if(parent == KNULL || child == KNULL || child->vm_areas != NULL)
+        return MMU_MAPPING_INVAL;
+
+    cpu_flags_t cpu_flags = hal_disable_interrupts();
+    struct vm_area** link = &child->vm_areas;
+
+    for(struct vm_area* area = parent->vm_areas; area != NULL; area = area->next)
+    {
+        struct vm_area* copy = kmalloc(sizeof(struct vm_area));
+        copy->base = area->base;
+        copy->end = area->end;
+        copy->flags = area->flags;
+        copy->next = NULL;
+
+        *link = copy;
+        link = &copy->next;
+
+        area_share_pages(area, child);
+    }
+
+    hal_enable_interrupts(cpu_flags);
+    return 0;
+}
+
+void vma_destroy(process_t* process)
+{
+    if(process == KNULL)
+        return;
+
+    cpu_flags_t cpu_flags = hal_disable_interrupts();
+    struct vm_area* area = process->vm_areas;
+
+    while(area != NULL)
+    {
+        struct vm_area* next = area->next;
+        kfree(area);
+        area = next;
+    }
+
+    process->vm_areas = NULL;
+    hal_enable_interrupts(cpu_flags);
+}
+
+bool vma_handle_fault(void* address, uint32_t access, bool was_present)
+{
+    thread_t* thread = sched_active_thread();
+
+    // No processes exist yet
+    if(thread == KNULL || thread->parent == KNULL)
+        return false;
+
+    struct vm_area* area = vma_find(thread->parent, address);
+    void* page = (void*)((uintptr_t)address & ~PAGE_MASK);
+
+    if(area == NULL || (area->flags & access) != access)
+        return false;
+
+    if(was_present)
+    {
+        // Only writes to shared pages are handled
+        if(!(access & MMU_ACCESS_W))
+            return false;
+
+        // Already unshared by someone else
+        if(mmu_check_access(page, MMU_ACCESS_W))
+            return true;
+
+        return area_unshare_page(area, page);
+    }
+
+    unsigned long frame = mm_alloc_zeroed(1);
+    int status = mmu_map(page, frame, area->flags);
+
+    if(status != 0)
+    {
+        // Someone else could have faulted the page in first
+        mm_free(frame, 1);
+        return status == MMU_MAPPING_EXISTS;
+    }
+
+    return true;
+}
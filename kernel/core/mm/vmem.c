@@ -0,0 +1,448 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include <common/hal.h>
+#include <common/mm/mm.h>
+#include <common/mm/vmem.h>
+#include <common/util/kfuncs.h>
+
+#include <arch/iobase.h>
+
+#define BOOT_TAGS       256     // Enough for the early physical memory manager
+#define TAG_RESERVE     4       // Tags needed to allocate a page of new tags
+
+enum seg_type
+{
+    SEG_FREE = 0,
+    SEG_ALLOC,
+};
+
+/*
+ * Boundary tag for a range of addresses
+ */
+struct vmem_seg
+{
+    uintptr_t base;
+    size_t size;
+    struct vmem_seg* prev;          // Address ordered segment list
+    struct vmem_seg* next;
+    struct vmem_seg* link_prev;     // Free list or hash chain
+    struct vmem_seg* link_next;
+    enum seg_type type;
+};
+
+vmem_t io_arena;
+vmem_t kstack_arena;
+
+static struct vmem_seg boot_tags[BOOT_TAGS];
+static struct vmem_seg* free_tags = NULL;
+static size_t free_tag_count = 0;
+static bool boot_tags_added = false;
+static bool can_refill_tags = false;
+
+static unsigned int highbit(size_t value)
+{
+    unsigned int bit = 0;
+
+    while(value >>= 1)
+        bit++;
+
+    return bit;
+}
+
+// Tag management
+static void tag_push(struct vmem_seg* tag)
+{
+    tag->next = free_tags;
+    free_tags = tag;
+    free_tag_count++;
+}
+
+static struct vmem_seg* tag_pop()
+{
+    struct vmem_seg* tag = free_tags;
+
+    if(tag == NULL)
+        kpanic("vmem: Out of boundary tags");
+
+    free_tags = tag->next;
+    free_tag_count--;
+
+    memset(tag, 0, sizeof(struct vmem_seg));
+    return tag;
+}
+
+// Free list & hash utilities
+static void list_insert(struct vmem_seg** head, struct vmem_seg* seg)
+{
+    seg->link_prev = NULL;
+    seg->link_next = *head;
+
+    if(*head != NULL)
+        (*head)->link_prev = seg;
+    *head = seg;
+}
+
+static void list_remove(struct vmem_seg** head, struct vmem_seg* seg)
+{
+    if(seg->link_prev != NULL)
+        seg->link_prev->link_next = seg->link_next;
+    else
+        *head = seg->link_next;
+
+    if(seg->link_next != NULL)
+        seg->link_next->link_prev = seg->link_prev;
+}
+
+static struct vmem_seg** freelist_of(vmem_t* arena, struct vmem_seg* seg)
+{
+    return &arena->freelist[highbit(seg->size)];
+}
+
+static struct vmem_seg** hash_of(vmem_t* arena, uintptr_t base)
+{
+    return &arena->hash[(base / arena->quantum) % VMEM_HASH_SIZE];
+}
+
+/*
+ * Creates a segment right after the given one (or at the head if NULL)
+ */
+static struct vmem_seg* seg_create(vmem_t* arena, struct vmem_seg* after, uintptr_t base, size_t size)
+{
+    struct vmem_seg* seg = tag_pop();
+    seg->base = base;
+    seg->size = size;
+    seg->type = SEG_FREE;
+    seg->prev = after;
+
+    if(after == NULL)
+    {
+        seg->next = arena->segments;
+        arena->segments = seg;
+    }
+    else
+    {
+        seg->next = after->next;
+        after->next = seg;
+    }
+
+    if(seg->next != NULL)
+        seg->next->prev = seg;
+
+    list_insert(freelist_of(arena, seg), seg);
+    return seg;
+}
+
+/*
+ * Removes a free segment, giving its tag back
+ */
+static void seg_destroy(vmem_t* arena, struct vmem_seg* seg)
+{
+    list_remove(freelist_of(arena, seg), seg);
+
+    if(seg->prev != NULL)
+        seg->prev->next = seg->next;
+    else
+        arena->segments = seg->next;
+
+    if(seg->next != NULL)
+        seg->next->prev = seg->prev;
+
+    tag_push(seg);
+}
+
+/*
+ * Allocates from the segment lists, using the smallest free list that may fit
+ * Needs at most 2 free tags
+ */
+static uintptr_t arena_alloc(vmem_t* arena, size_t size, size_t align)
+{
+    struct vmem_seg* seg = NULL;
+    uintptr_t base = 0;
+
+    for(size_t list = highbit(size); list < VMEM_FREELISTS && seg == NULL; list++)
+    {
+        for(struct vmem_seg* node = arena->freelist[list]; node != NULL; node = node->link_next)
+        {
+            base = (node->base + align - 1) & ~(align - 1);
+
+            if(base - node->base < node->size && node->size - (base - node->base) >= size)
+            {
+                seg = node;
+                break;
+            }
+        }
+    }
+
+    if(seg == NULL)
+        return 0;
+
+    // Split off the unused space before & after the allocation
+    list_remove(freelist_of(arena, seg), seg);
+
+    if(base != seg->base)
+    {
+        seg_create(arena, seg->prev, seg->base, base - seg->base);
+        seg->size -= base - seg->base;
+        seg->base = base;
+    }
+
+    if(seg->size != size)
+    {
+        seg_create(arena, seg, base + size, seg->size - size);
+        seg->size = size;
+    }
+
+    seg->type = SEG_ALLOC;
+    list_insert(hash_of(arena, base), seg);
+    arena->in_use += size;
+
+    return base;
+}
+
+/*
+ * Returns an allocated range to the segment lists, merging it with any free neighbours
+ */
+static void arena_free(vmem_t* arena, uintptr_t base, size_t size)
+{
+    struct vmem_seg* seg = *hash_of(arena, base);
+
+    while(seg != NULL && seg->base != base)
+        seg = seg->link_next;
+
+    if(seg == NULL || seg->size != size)
+        kpanic("vmem: Bad free of %p (%d bytes) in arena %s", base, size, arena->name);
+
+    list_remove(hash_of(arena, base), seg);
+    seg->type = SEG_FREE;
+    arena->in_use -= size;
+
+    struct vmem_seg* prev = seg->prev;
+    struct vmem_seg* next = seg->next;
+
+    if(next != NULL && next->type == SEG_FREE && seg->base + seg->size == next->base)
+    {
+        seg->size += next->size;
+        seg_destroy(arena, next);
+    }
+
+    if(prev != NULL && prev->type == SEG_FREE && prev->base + prev->size == seg->base)
+    {
+        list_remove(freelist_of(arena, prev), prev);
+        prev->size += seg->size;
+        list_insert(freelist_of(arena, prev), prev);
+
+        // Not on a free list yet, so unlink it by hand
+        prev->next = seg->next;
+        if(seg->next != NULL)
+            seg->next->prev = prev;
+        tag_push(seg);
+        return;
+    }
+
+    list_insert(freelist_of(arena, seg), seg);
+}
+
+/*
+ * Makes sure there are enough tags for any one operation.
+ * New tag pages come from the direct map, or from the arena itself where
+ * there isn't one.
+ */
+static void tag_refill(vmem_t* arena)
+{
+    while(can_refill_tags && free_tag_count < TAG_RESERVE)
+    {
+        unsigned long frame = mm_alloc(1);
+        struct vmem_seg* tags = mmu_phys_to_virt(frame);
+
+        if(tags == KNULL)
+        {
+            size_t size = (PAGE_SIZE + arena->quantum - 1) & ~(arena->quantum - 1);
+            uintptr_t base = arena_alloc(arena, size, PAGE_SIZE);
+
+            if(base == 0)
+                kpanic("vmem: No space for boundary tags in arena %s", arena->name);
+
+            tags = (struct vmem_seg*)base;
+            mmu_map(tags, frame, MMU_FLAGS_DEFAULT);
+        }
+
+        for(size_t i = 0; i < PAGE_SIZE / sizeof(struct vmem_seg); i++)
+            tag_push(&tags[i]);
+    }
+}
+
+/*
+ * Gives every cached allocation back to the segment lists
+ */
+static void qcache_purge(vmem_t* arena)
+{
+    for(size_t i = 0; i < VMEM_QCACHE_MAX; i++)
+    {
+        size_t size = (i + 1) * arena->quantum;
+
+        while(arena->qcache[i].count > 0)
+            arena_free(arena, arena->qcache[i].entries[--arena->qcache[i].count], size);
+    }
+}
+
+void vmem_create(vmem_t* arena, const char* name, uintptr_t base, size_t size, size_t quantum, size_t qcache_max)
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(!boot_tags_added)
+    {
+        for(size_t i = 0; i < BOOT_TAGS; i++)
+            tag_push(&boot_tags[i]);
+        boot_tags_added = true;
+    }
+
+    memset(arena, 0, sizeof(vmem_t));
+    arena->name = name;
+    arena->base = base;
+    arena->size = size & ~(quantum - 1);
+    arena->quantum = quantum;
+
+    if(qcache_max > VMEM_QCACHE_MAX * quantum)
+        qcache_max = VMEM_QCACHE_MAX * quantum;
+    arena->qcache_max = qcache_max;
+
+    seg_create(arena, NULL, base, arena->size);
+
+    hal_enable_interrupts(flags);
+}
+
+void* vmem_xalloc(vmem_t* arena, size_t size, size_t align)
+{
+    if(size == 0)
+        return KNULL;
+
+    size = (size + arena->quantum - 1) & ~(arena->quantum - 1);
+    if(align < arena->quantum)
+        align = arena->quantum;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+    uintptr_t base = 0;
+
+    if(size <= arena->qcache_max && align == arena->quantum)
+    {
+        size_t index = size / arena->quantum - 1;
+
+        if(arena->qcache[index].count > 0)
+            base = arena->qcache[index].entries[--arena->qcache[index].count];
+    }
+
+    if(base == 0)
+    {
+        tag_refill(arena);
+        base = arena_alloc(arena, size, align);
+    }
+
+    if(base == 0)
+    {
+        // The caches may be holding onto the space needed
+        qcache_purge(arena);
+        base = arena_alloc(arena, size, align);
+    }
+
+    if(base == 0)
+    {
+        arena->fail_count++;
+        hal_enable_interrupts(flags);
+        return KNULL;
+    }
+
+    arena->alloc_count++;
+
+    hal_enable_interrupts(flags);
+    return (void*)base;
+}
+
+void* vmem_alloc(vmem_t* arena, size_t size)
+{
+    return vmem_xalloc(arena, size, arena->quantum);
+}
+
+void vmem_free(vmem_t* arena, void* address, size_t size)
+{
+    if(address == KNULL || size == 0)
+        return;
+
+    size = (size + arena->quantum - 1) & ~(arena->quantum - 1);
+
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(size <= arena->qcache_max)
+    {
+        size_t index = size / arena->quantum - 1;
+
+        if(arena->qcache[index].count < VMEM_QCACHE_DEPTH)
+        {
+            arena->qcache[index].entries[arena->qcache[index].count++] = (uintptr_t)address;
+            hal_enable_interrupts(flags);
+            return;
+        }
+    }
+
+    arena_free(arena, (uintptr_t)address, size);
+
+    hal_enable_interrupts(flags);
+}
+
+void vmem_init()
+{
+    // Skip over the first page, as ACPI uses it for temporary mappings
+    vmem_create(&io_arena, "io", MMIO_MAP_BASE + PAGE_SIZE, MMIO_MAP_SIZE - PAGE_SIZE, PAGE_SIZE, 4 * PAGE_SIZE);
+    vmem_create(&kstack_arena, "kstack", KSTACK_BASE, KSTACK_SIZE, PAGE_SIZE, 0);
+
+    can_refill_tags = true;
+}
+
+// IO Mappings
+void* ioremap(unsigned long address, size_t size, uint32_t flags)
+{
+    size_t offset = address & PAGE_MASK;
+    size_t map_size = PAGE_ROUNDUP(offset + size);
+    void* base = vmem_alloc(&io_arena, map_size);
+
+    if(base == KNULL)
+        return KNULL;
+
+    if(mmu_map_range(base, address & ~PAGE_MASK, map_size, flags) != 0)
+    {
+        mmu_unmap_range(base, map_size, false);
+        vmem_free(&io_arena, base, map_size);
+        return KNULL;
+    }
+
+    return (uint8_t*)base + offset;
+}
+
+void iounmap(void* address, size_t size)
+{
+    size_t offset = (uintptr_t)address & PAGE_MASK;
+    size_t map_size = PAGE_ROUNDUP(offset + size);
+    void* base = (uint8_t*)address - offset;
+
+    mmu_unmap_range(base, map_size, false);
+    vmem_free(&io_arena, base, map_size);
+}
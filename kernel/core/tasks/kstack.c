@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/hal.h>
+#include <common/mm/mm.h>
+#include <common/mm/vmem.h>
+#include <common/tasks/tasks.h>
+#include <common/util/kfuncs.h>
+
+#define KSTACK_SLOT_SIZE (THREAD_STACK_SIZE + PAGE_SIZE)   // Stack, with a guard page below it
+#define KSTACK_CACHE_SIZE 16
+
+// Stacks of exited threads, still mapped
+static uintptr_t stack_cache[KSTACK_CACHE_SIZE];
+static size_t cached_stacks = 0;
+
+unsigned long kstack_alloc()
+{
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(cached_stacks > 0)
+    {
+        uintptr_t stack_base = stack_cache[--cached_stacks];
+        hal_enable_interrupts(flags);
+        return stack_base + KSTACK_SLOT_SIZE;
+    }
+
+    hal_enable_interrupts(flags);
+
+    uint8_t* stack_base = vmem_alloc(&kstack_arena, KSTACK_SLOT_SIZE);
+
+    if(stack_base == KNULL)
+        kpanic("Out of kernel stack space");
+
+    // Map stack pages, leaving the guard page unmapped
+    for(int i = 0; i < (THREAD_STACK_SIZE >> 12); i++)
+        mmu_map(stack_base + PAGE_SIZE + (i << 12), mm_alloc(1), MMU_FLAGS_DEFAULT);
+
+    return (unsigned long)(stack_base + KSTACK_SLOT_SIZE);
+}
+
+void kstack_free(unsigned long stacktop)
+{
+    uint8_t* stack_base = (uint8_t*)(stacktop - KSTACK_SLOT_SIZE);
+
+    // Only stacks from the stack arena are freed (not the boot stack)
+    if((uintptr_t)stack_base < kstack_arena.base || (uintptr_t)stack_base >= kstack_arena.base + kstack_arena.size)
+        return;
+
+    cpu_flags_t flags = hal_disable_interrupts();
+
+    if(cached_stacks < KSTACK_CACHE_SIZE)
+    {
+        // Keep the stack mapped for the next thread
+        stack_cache[cached_stacks++] = (uintptr_t)stack_base;
+        hal_enable_interrupts(flags);
+        return;
+    }
+
+    hal_enable_interrupts(flags);
+
+    // Free stack pages
+    for(int i = 0; i < (THREAD_STACK_SIZE >> 12); i++)
+        mm_free(mmu_get_mapping(stack_base + PAGE_SIZE + (i << 12)), 1);
+
+    mmu_unmap_range(stack_base + PAGE_SIZE, THREAD_STACK_SIZE, true);
+    vmem_free(&kstack_arena, stack_base, KSTACK_SLOT_SIZE);
+}
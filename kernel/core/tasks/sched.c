@@ -38,14 +38,16 @@ struct sleep_node
     struct sleep_node* next;
 };
 
-#define QUANTA_LENGTH (15 * 1000000) // 15000000ns =  15ms
-
 static thread_t* active_thread = KNULL;
-static thread_t* idle_thread;
+static thread_t* idle_thread = KNULL;
 static thread_t* cleanup_thread;
 
-// Queue of threads that can be run, but aren't actively running
-struct thread_queue run_queue = {.queue_head = KNULL, .queue_tail = KNULL};
+// Queues of threads that can be run, but aren't actively running, one per priority
+struct thread_queue run_queues[PRIORITY_COUNT] = {
+    [0 ... PRIORITY_COUNT - 1] = {.queue_head = KNULL, .queue_tail = KNULL}
+};
+// Bit n is set if run_queues[n] isn't empty
+static uint32_t ready_priorities = 0;
 static struct thread_queue exit_queue = {.queue_head = KNULL, .queue_tail = KNULL};
 static thread_t* sleep_filo_head = KNULL;
 
@@ -59,7 +61,6 @@ static bool taskswitch_postponed = false;
 static bool preempt_enabled = false;
 static uint64_t flags = 0;
 
-// static struct thread_queue thread_queues[PRIORITY_COUNT];
 // static struct thread_queue sleep_queue;
 // static struct thread_queue blocked_queue;
 // static struct sleep_node* sleepers = KNULL;
@@ -68,7 +69,8 @@ static uint64_t flags = 0;
 // static bool clean_sleepers = false;
 // static bool idle_entry = false;
 
-/*static unsigned int get_timeslice(enum thread_priority priority)
+// Gets the timeslice of a priority, in milliseconds
+static unsigned int get_timeslice(enum thread_priority priority)
 {
     switch(priority)
     {
@@ -81,7 +83,7 @@ static uint64_t flags = 0;
         case PRIORITY_IDLE: return 1;
         default: return 0;
     }
-}*/
+}
 
 /*
  * Note: taskswitch_disable/enable pair must be called on the outermost handler
@@ -173,32 +175,45 @@ void sched_queue_thread_to(thread_t *thread, struct thread_queue *queue)
 
 void sched_queue_thread(thread_t *thread)
 {
-    sched_queue_thread_to(thread, &run_queue);
+    // The idle thread is only run when the run queues are empty
+    if(thread == idle_thread)
+        return;
+
+    thread->next = KNULL;
+    sched_queue_thread_to(thread, &run_queues[thread->priority]);
+    ready_priorities |= (1 << thread->priority);
 }
 
+/*
+ * Gets the highest priority thread that can be run, without removing it
+ */
 static thread_t* sched_next_thread()
 {
-    struct thread_queue *queue = &run_queue;
-    if(queue->queue_head != KNULL)
-    {
-        thread_t *next_thread = queue->queue_head;
-        while(next_thread->current_state > STATE_READY)
-        {
-            next_thread = next_thread->next;
-            if(next_thread == KNULL) break;
-        }
+    if(ready_priorities == 0)
+        return idle_thread;
 
-        if(next_thread != KNULL)
-            return next_thread;
-    }
+    return run_queues[31 - __builtin_clz(ready_priorities)].queue_head;
+}
 
-    return idle_thread;
+/*
+ * Removes the thread from the front of its run queue
+ */
+static void sched_dequeue_thread(thread_t *thread)
+{
+    struct thread_queue *queue = &run_queues[thread->priority];
+
+    sched_queue_remove(thread, queue);
+
+    if(queue->queue_head == KNULL)
+        ready_priorities &= ~(1 << thread->priority);
 }
 
 void sched_init()
 {
-    if(run_queue.queue_head != KNULL)
-        cleanup_thread = thread_create(run_queue.queue_head->parent, cleanup_task, PRIORITY_LOW, "cleanup_task", NULL);
+    thread_t* init_thread = sched_next_thread();
+
+    if(init_thread != KNULL && init_thread != idle_thread)
+        cleanup_thread = thread_create(init_thread->parent, cleanup_task, PRIORITY_LOW, "cleanup_task", NULL);
 
     timer_add_handler(0, sched_timer);
 }
@@ -319,7 +334,7 @@ static void switch_to_thread(thread_t* next_thread)
     if(next_thread == idle_thread)
         current_timeslice = 0;
     else
-        current_timeslice = QUANTA_LENGTH;
+        current_timeslice = get_timeslice(next_thread->priority) * 1000000ULL;
 
     next_thread->current_state = STATE_RUNNING;
     mmu_set_context(next_thread->parent->page_context_base);
@@ -329,20 +344,23 @@ static void switch_to_thread(thread_t* next_thread)
 // Debugs start
 void sched_print_queues()
 {
-    thread_t* node = run_queue.queue_head;
-    printf("Run Queue: ");
+    printf("Run Queues: ");
 
     if(active_thread != KNULL)
         printf("[%s] -> ", active_thread->name);
-    
-    while(node != KNULL)
+
+    for(int priority = PRIORITY_COUNT - 1; priority >= 0; priority--)
     {
-        printf("%s -> ", node->name);
-        node = node->next;
+        thread_t* node = run_queues[priority].queue_head;
+
+        while(node != KNULL)
+        {
+            printf("%s(%d) -> ", node->name, priority);
+            node = node->next;
+        }
     }
-    
-    if(run_queue.queue_tail != KNULL)
-        printf("<%s>\n", run_queue.queue_tail->name);
+
+    printf("<%s>\n", idle_thread != KNULL ? idle_thread->name : "none");
 }
 
 unsigned long long tswp_counter = 0;
@@ -366,46 +384,27 @@ void sched_switch_thread()
     }
 
     sched_track_swaps();
-    if(run_queue.queue_head != KNULL)
-    {
-        // We have a next thread, so switch to it
-        thread_t* next_thread = run_queue.queue_head;
-        run_queue.queue_head = next_thread->next;
+    thread_t* next_thread = sched_next_thread();
 
-        if(next_thread == idle_thread)
-        {
-            // Next thread is the idle thread, although there may be other options
-            if(run_queue.queue_head != KNULL)
-            {
-                // Still a thread in the queue, so swap places with idle thread.
-                next_thread = run_queue.queue_head;
-                idle_thread->next = next_thread->next;
-                run_queue.queue_head = idle_thread;
-
-                // Should idle thread be the last thread in the queue, set it to be the tail
-                if(idle_thread->next == KNULL)
-                    run_queue.queue_tail = idle_thread;
+    if(next_thread == KNULL)
+        return;
 
-                next_thread->next = KNULL;
-            }
-            else if (active_thread->current_state == STATE_RUNNING)
-            {
-                // No other threads in the queue, but the current one is still running. Just return
-                sched_queue_thread(next_thread);
-                return;
-            }
-            else {
-                // Idle thread is the only one left.
-                sched_queue_remove(idle_thread, &run_queue);
-            }
-        }
-        else {
-            // Remove next thread from run queue
-            sched_queue_remove(next_thread, &run_queue);
+    if(active_thread != KNULL && active_thread->current_state == STATE_RUNNING)
+    {
+        // Lower priority threads never preempt the current one, and equal
+        // priority threads only take turns with it
+        if(next_thread == active_thread || (active_thread != idle_thread && next_thread->priority < active_thread->priority))
+        {
+            if(active_thread != idle_thread)
+                current_timeslice = get_timeslice(active_thread->priority) * 1000000ULL;
+            return;
         }
-
-        switch_to_thread(next_thread);
     }
+
+    if(next_thread != idle_thread)
+        sched_dequeue_thread(next_thread);
+
+    switch_to_thread(next_thread);
 }
 
 void sched_block_thread(enum thread_state new_state)
@@ -424,23 +423,12 @@ void sched_unblock_thread(thread_t* thread)
 
     sched_lock();
     thread->current_state = STATE_READY;
+    sched_queue_thread(thread);
 
-    if(run_queue.queue_head == KNULL || (active_thread == idle_thread))
-    {
-        // Should there be no next task to run, pre-empt the current one
-        switch_to_thread(thread);
-
-        if(taskswitch_postponed)
-        {
-            // If the task switch was postponed (ie. during sleeper wakeup), just queue the thread for later
-            sched_queue_thread(thread);
-        }
-    }
-    else
-    {
-        // Otherwise, add back to run queue
-        sched_queue_thread(thread);
-    }
+    // Pre-empt the current thread if the woken one is more important
+    // (the switch is postponed if task switches are disabled, ie. during sleeper wakeup)
+    if(active_thread == KNULL || active_thread == idle_thread || thread->priority > active_thread->priority)
+        sched_switch_thread();
 
     sched_unlock();
 }
@@ -23,6 +23,8 @@
 
 #include <common/mm/liballoc.h>
 #include <common/mm/mm.h>
+#include <common/mm/slab.h>
+#include <common/mm/vma.h>
 #include <common/sched/sched.h>
 #include <common/tasks/tasks.h>
 #include <common/ipc/message.h>
@@ -38,6 +40,17 @@ static unsigned int tid_counter = 2;
 process_t init_process = {};
 static thread_t init_thread = {};
 
+/*
+ * Message queues are constructed empty
+ */
+static void msg_queue_ctor(void* object)
+{
+    memset(object, 0, sizeof(struct ipc_message_queue));
+}
+
+static kmem_cache_t thread_cache = KMEM_CACHE_INIT("thread", sizeof(thread_t), 0, NULL);
+static kmem_cache_t msg_queue_cache = KMEM_CACHE_INIT("ipc_message_queue", sizeof(struct ipc_message_queue), 0, msg_queue_ctor);
+
 void tasks_init(char* init_name, void* init_entry)
 {
     // Build init process
@@ -72,6 +85,7 @@ process_t* process_create(const char *name)
     process->name = name;
     process->pid = pid_counter++;
     process->page_context_base = mmu_create_context();
+    process->vm_areas = NULL;
 
     if(process->parent != KNULL)
     {
@@ -83,6 +97,51 @@ process_t* process_create(const char *name)
     return process;
 }
 
+process_t* process_fork(const char *name)
+{
+    process_t* parent = sched_active_process();
+    process_t* child = process_create(name);
+
+    // Share the parent's pages until one of them writes to them
+    vma_fork(parent, child);
+
+    return child;
+}
+
+void process_destroy(process_t *process)
+{
+    // The init process lives forever
+    if(process == KNULL || process == &init_process) return;
+
+    // Orphan the children
+    for(process_t* child = process->child; child != KNULL; child = child->sibling)
+        child->parent = KNULL;
+
+    if(process->parent != KNULL)
+    {
+        // Remove the process from the parent child list
+        process_t* current = process->parent->child;
+        process_t* prev = KNULL;
+
+        while(current != process)
+        {
+            prev = current;
+            current = current->sibling;
+        }
+
+        if(prev != KNULL)
+            prev->sibling = current->sibling;
+        else
+            process->parent->child = current->sibling;
+    }
+
+    // The pages in the areas are freed along with the address space
+    vma_destroy(process);
+    mmu_destroy_context(process->page_context_base);
+
+    kfree(process);
+}
+
 void process_add_child(process_t *parent, thread_t *child)
 {
     child->sibling = parent->threads;
@@ -91,7 +150,7 @@ void process_add_child(process_t *parent, thread_t *child)
 
 thread_t* thread_create(process_t *parent, void *entry_point, enum thread_priority priority, const char* name, void* params)
 {
-    thread_t *thread = kmalloc(sizeof(thread_t));
+    thread_t *thread = kmem_cache_alloc(&thread_cache);
     memset(thread, 0, sizeof(thread_t));
 
     thread->parent = parent;
@@ -100,8 +159,7 @@ thread_t* thread_create(process_t *parent, void *entry_point, enum thread_priori
     thread->tid = tid_counter++;
     thread->priority = priority;
     thread->name = name;
-    thread->pending_msgs = kmalloc(sizeof(struct ipc_message_queue));
-    // TODO: Use a dedicated aligned stack allocator (ie. buddy)
+    thread->pending_msgs = kmem_cache_alloc(&msg_queue_cache);
     init_register_state(thread, entry_point, NULL, params);
 
     process_add_child(parent, thread);
@@ -119,7 +177,12 @@ void thread_destroy(thread_t *thread)
     cleanup_register_state(thread);
 
     // TODO: Do something with pending messages and senders
-    kfree(thread->pending_msgs);
+    if(thread->pending_msgs != NULL)
+    {
+        // Empty the queue, so that it is freed in its constructed state
+        msg_queue_ctor(thread->pending_msgs);
+        kmem_cache_free(&msg_queue_cache, thread->pending_msgs);
+    }
 
     if(thread->parent != KNULL)
     {
@@ -138,14 +201,16 @@ void thread_destroy(thread_t *thread)
         else
             thread->parent->threads = current->sibling;
 
-        /*if(thread->parent->threads == KNULL)
+        if(thread->parent->threads == KNULL)
         {
             // Destroy the process
             process_destroy(thread->parent);
-        }*/
+        }
     }
 
-    kfree(thread);
+    // The init thread isn't from the cache
+    if(thread != &init_thread)
+        kmem_cache_free(&thread_cache, thread);
 }
 
 /**
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ * 
+ * This file is part of Kernel4.
+ * 
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <common/util/kfuncs.h>
+
+size_t kappendf(char* buffer, size_t length, size_t index, const char* format, ...)
+{
+    // Keep the last byte for the terminator
+    if(index + 1 >= length)
+        return index;
+
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + index, length - index, format, args);
+    va_end(args);
+
+    if(written > 0)
+        index += (size_t)written;
+
+    if(index >= length)
+        index = length - 1;
+
+    return index;
+}
@@ -36,12 +36,9 @@ void klog_init()
     
     for(size_t i = 0; i < allocated_limit; i+= 0x1000)
     {
-        mmu_map(log_buffer + i, mm_alloc(1), MMU_FLAGS_DEFAULT);
+        mmu_map(log_buffer + i, mm_alloc_zeroed(1), MMU_FLAGS_DEFAULT);
     }
 
-    // Clear buffer of old data
-    memset(log_buffer, 0, allocated_limit);
-
     memcpy(log_buffer, early_klog_buffer, early_index);
     is_init = true;
     klog_logln(LVL_INFO, "Main Logger Initialzed");
@@ -79,8 +76,7 @@ static bool check_alloc()
     }
     else if(is_init && (allocated_limit - log_index) <= 4096)
     {
-        mmu_map(log_buffer + allocated_limit, mm_alloc(1), MMU_FLAGS_DEFAULT);
-        memset(log_buffer + allocated_limit, 0, 4096);
+        mmu_map(log_buffer + allocated_limit, mm_alloc_zeroed(1), MMU_FLAGS_DEFAULT);
         allocated_limit += 4096;
     }
 
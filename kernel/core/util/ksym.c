@@ -0,0 +1,132 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/fs/vfs.h>
+#include <common/mm/liballoc.h>
+#include <common/util/klog.h>
+#include <common/util/ksym.h>
+
+struct ksym
+{
+    uintptr_t address;
+    const char* name;
+};
+
+// Symbols in address order, as nm -n sorts them
+static struct ksym* symbols = NULL;
+static size_t symbol_count = 0;
+
+bool ksym_load(const char* path)
+{
+    if(symbols != NULL)
+        return true;
+
+    struct vfs_mount* mount = vfs_get_mount("/");
+
+    if(mount == KNULL || mount == NULL)
+        return false;
+
+    struct dnode* dnode = vfs_find_dir(mount->instance->root, path);
+
+    if(dnode == NULL)
+    {
+        klog_logln(LVL_WARN, "ksym: Symbol table %s doesn't exist", path);
+        return false;
+    }
+
+    struct inode* inode = to_inode(dnode);
+    char* contents = kmalloc(inode->size + 1);
+    size_t lines = 0;
+
+    vfs_open(inode, VFSO_RDONLY);
+    ssize_t length = vfs_read(inode, 0, inode->size, contents);
+    vfs_close(inode);
+
+    if(length <= 0)
+    {
+        kfree(contents);
+        return false;
+    }
+
+    contents[length] = '\0';
+
+    for(ssize_t i = 0; i < length; i++)
+    {
+        if(contents[i] == '\n')
+            lines++;
+    }
+
+    struct ksym* table = kmalloc(sizeof(struct ksym) * (lines + 1));
+    char* line = contents;
+    size_t count = 0;
+
+    // Each line is "<address> <name>"
+    while(*line != '\0')
+    {
+        char* name;
+        char* end = (char*)strchr(line, '\n');
+
+        if(end != NULL)
+            *end = '\0';
+
+        table[count].address = strtoul(line, &name, 16);
+
+        if(name != line && *name == ' ')
+            table[count++].name = name + 1;
+
+        if(end == NULL)
+            break;
+
+        line = end + 1;
+    }
+
+    // The names stay in the file contents
+    symbol_count = count;
+    symbols = table;
+    return true;
+}
+
+const char* ksym_lookup(uintptr_t address, uintptr_t* offset)
+{
+    if(symbols == NULL || symbol_count == 0 || address < symbols[0].address)
+        return NULL;
+
+    // Find the last symbol at or below the address
+    size_t low = 0;
+    size_t high = symbol_count;
+
+    while(high - low > 1)
+    {
+        size_t middle = low + (high - low) / 2;
+
+        if(symbols[middle].address <= address)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    if(offset != NULL)
+        *offset = address - symbols[low].address;
+
+    return symbols[low].name;
+}
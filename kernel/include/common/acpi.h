@@ -4,6 +4,7 @@
 #include <acpi.h>
 
 #define ACPI_MAX_EARLY_TABLES 16
+#define ACPI_MAX_TABLES 64
 
 /**
  * @brief  Initializes the early parts of the ACPI subsystem (ie table traversal)
@@ -43,6 +44,13 @@ void acpi_put_table(ACPI_TABLE_HEADER* table);
 
 void acpi_get_pirt();
 
+/**
+ * @brief  Gives the ACPI reclaimable memory back to the memory manager
+ * @note   Must be called after acpi_init. Frames holding tables are kept.
+ * @retval None
+ */
+void acpi_reclaim_memory();
+
 /**
  * @brief  Enters the specifed sleep state
  * @note   
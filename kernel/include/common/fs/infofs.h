@@ -0,0 +1,39 @@
+#include <common/fs/vfs.h>
+
+#ifndef __FS_INFOFS__
+#define __FS_INFOFS__
+
+/**
+ * Fills the buffer with the contents of the file
+ * Returns the length of the contents
+ */
+typedef size_t (*infofs_generate_t)(char* buffer, size_t length);
+
+struct infofs_inode
+{
+    struct inode inode;
+    infofs_generate_t generate;
+};
+
+struct infofs_dnode
+{
+    struct dnode dnode;
+
+    struct infofs_dnode *next;
+};
+
+struct infofs_instance
+{
+    struct fs_instance instance;
+
+    struct infofs_dnode *dnodes;
+    ino_t next_inode;
+};
+
+struct fs_instance* infofs_create();
+
+void infofs_add_file(struct infofs_instance* instance, infofs_generate_t generate, const char* path);
+
+void infofs_destroy(struct fs_instance* instance);
+
+#endif /* __FS_INFOFS__ */
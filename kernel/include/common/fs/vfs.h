@@ -1,6 +1,7 @@
 #include <common/types.h>
 #include <sys/types.h>
 
+#include <common/mm/slab.h>
 #include <common/util/locks.h>
 
 #ifndef __VFS_H__
@@ -40,7 +41,7 @@ typedef void (*vfs_close_func_t)(struct inode *file_node);
  * Node is the directory to start searching from
  * Dirent is the dirent to fill up and is the one returned
  */
-typedef struct dirent* (*vfs_readdir_func_t)(struct inode *node, size_t index, struct dirent* dirent);
+typedef struct dirent* (*vfs_readdir_func_t)(struct dnode *dnode, size_t index, struct dirent* dirent);
 /** 
  * Gets a vfs_inode from a name. Returns NULL if not found
  * May create a new vfs inode
@@ -119,6 +120,10 @@ struct dirent {
     const char* name;
 };
 
+// Caches for the generic nodes
+extern kmem_cache_t inode_cache;
+extern kmem_cache_t dnode_cache;
+
 void vfs_mount(struct fs_instance* mount, const char* path);
 struct vfs_mount* vfs_get_mount(const char* path);
 ssize_t vfs_read(struct inode *root_node, size_t off, size_t len, void* buffer);
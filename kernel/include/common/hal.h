@@ -113,6 +113,12 @@ struct irq_handler* ic_irq_handle(uint8_t irq, uint32_t flags, irq_function_t ha
  */
 void ic_irq_free(struct irq_handler* handler);
 
+/**
+ * @brief  Gets the NUMA node of the current cpu
+ * @retval The node id, or 0 if there is no NUMA information
+ */
+unsigned int hal_get_cpu_node();
+
 struct heap_info* get_heap_info();
 void* get_klog_base();
 
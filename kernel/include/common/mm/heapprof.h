@@ -0,0 +1,45 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/types.h>
+
+#ifndef __HEAPPROF_H__
+#define __HEAPPROF_H__ 1
+
+/*
+ * Heap profiler
+ * Enabled by building with ENABLE_HEAP_PROFILER, which makes kmalloc & friends
+ * record the caller of every allocation
+ */
+#define HEAPPROF_SITES      256     // Call sites tracked
+#define HEAPPROF_TRACKED    8192    // Live allocations tracked
+#define HEAPPROF_BUCKETS    14      // Size histogram buckets, from 16 bytes to 64KiB & up
+
+/**
+ * @brief  Formats the heap profile into a buffer
+ * @note   Call sites are resolved through the kernel's symbol table, if it
+ *         has been loaded by ksym_load
+ * @param  buffer: The buffer to write the profile into
+ * @param  length: The length of the buffer
+ * @retval The number of bytes written, excluding the null terminator
+ */
+size_t heapprof_format_info(char* buffer, size_t length);
+
+#endif /* __HEAPPROF_H__ */
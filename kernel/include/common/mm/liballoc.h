@@ -64,6 +64,36 @@ extern void* liballoc_alloc(size_t);
  */
 extern int liballoc_free(void*,size_t);
 
+/** Rounds a small allocation size up to its magazine size class, so that
+ * the allocation can be reused by liballoc_magazine_alloc once freed.
+ *
+ * \return The rounded size, or the same size if it is too large.
+ */
+extern size_t liballoc_magazine_round(size_t);
+
+/** Takes a recently freed allocation of the size from the current cpu's
+ * magazines. Neither takes the liballoc lock nor disables interrupts.
+ *
+ * \return NULL if there are no allocations of the size cached.
+ * \return A pointer to the allocation.
+ */
+extern void* liballoc_magazine_alloc(size_t);
+
+/** Gives an allocation to the current cpu's magazines, instead of freeing
+ * it. The integer value is the requested size of the allocation.
+ *
+ * \return 0 if the allocation was taken by the magazines.
+ */
+extern int liballoc_magazine_free(void*,size_t);
+
+/** Takes up to the given number of the oldest allocations of the size
+ * out of the current cpu's magazines, so that they can be freed back
+ * into the heap. The integer value is the requested size of the allocations.
+ *
+ * \return The number of allocations taken.
+ */
+extern size_t liballoc_magazine_drain(size_t,void**,size_t);
+
 
 
 
@@ -72,6 +102,14 @@ extern void    *PREFIX(realloc)(void *, size_t);    ///< The standard function.
 extern void    *PREFIX(calloc)(size_t, size_t);        ///< The standard function.
 extern void     PREFIX(free)(void *);                ///< The standard function.
 
+#ifdef ENABLE_HEAP_PROFILER
+// The allocator without profiling, wrapped by the heap profiler
+extern void    *liballoc_raw_malloc(size_t);
+extern void    *liballoc_raw_realloc(void *, size_t);
+extern void    *liballoc_raw_calloc(size_t, size_t);
+extern void     liballoc_raw_free(void *);
+#endif
+
 
 #ifdef __cplusplus
 }
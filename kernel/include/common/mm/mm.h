@@ -69,6 +69,9 @@ enum MemoryRegionType
 typedef struct paging_context
 {
     unsigned long phybase;
+    unsigned long switch_base;  // Value loaded on a switch, with the address space id & flush hint
+    uint16_t asid;              // Address space id (PCID), if supported
+    bool tlb_stale;             // The address space id may have stale entries, so the next switch flushes
 } paging_context_t;
 
 void mmu_init();
@@ -83,25 +86,63 @@ void mmu_init();
  */
 int mmu_map(void* address, unsigned long mapping, uint32_t flags);
 
+/**
+ * @brief  Maps a physically contiguous range to the linear address
+ * @note   Large pages (2MiB & 1GiB on x86_64, 4MiB on i386) are used wherever
+ *         both addresses are aligned to and the range covers the page size,
+ *         except where a page table already exists
+ *         Each table is walked once, and no TLB flushes are needed
+ * @param  address: The linear address to start mapping at
+ * @param  mapping: The physical address to map to
+ * @param  size: The size of the range, in bytes
+ * @param  flags: The flags used in the mappings
+ * @retval See MMU_MAPPING_xxx error codes
+ */
+int mmu_map_range(void* address, unsigned long mapping, size_t size, uint32_t flags);
+
 /**
  * @brief  Sets up a new mapping attribute for the mapping specified
  * @note   Implicitly invalidates the page entry for cache reloading
  *         Also changes the privilage bit on all levels
+ *         For a large page, the whole page is changed
  * @param  address: The linear address to change the mapping attributes
  * @param  flags: The new attributes to set to
  * @retval See MMU_MAPPING_xxx error codes
  */
 int mmu_change_attr(void* address, uint32_t flags);
 
+/**
+ * @brief  Sets up new mapping attributes for every mapping in the range
+ * @note   Each table is walked once, and the TLB is flushed once at the end
+ *         Large pages overlapping the range are changed as a whole
+ *         Pages which aren't present are skipped
+ * @param  address: The linear address to start at
+ * @param  size: The size of the range, in bytes
+ * @param  flags: The new attributes to set to
+ * @retval See MMU_MAPPING_xxx error codes. MMU_MAPPING_ERROR is returned if
+ *         part of the range has no page tables, but the rest is still changed
+ */
+int mmu_protect_range(void* address, size_t size, uint32_t flags);
+
 /**
  * @brief  Unmaps the specified addres
- * @note   
+ * @note   For a large page, the whole page is unmapped and erased
  * @param  address: The address mapping to unlink
  * @param  erase_entry: If true, the entry should be completely erased
  * @retval True if unmapping was done successfully, false otherwise
  */
 bool mmu_unmap(void* address, bool erase_entry);
 
+/**
+ * @brief  Unmaps every mapping in the range
+ * @note   Each table is walked once, and the TLB is flushed once at the end
+ *         Large pages overlapping the range are unmapped as a whole
+ * @param  address: The linear address to start at
+ * @param  size: The size of the range, in bytes
+ * @param  erase_entry: If true, the entries should be completely erased
+ */
+void mmu_unmap_range(void* address, size_t size, bool erase_entry);
+
 /**
  * @brief  Gets the mapping address from the linear address
  * @note   
@@ -119,6 +160,30 @@ unsigned long mmu_get_mapping(void* address);
  */
 bool mmu_check_access(void* address, uint32_t flags);
 
+/**
+ * @brief  Finds the first mapped page at or after the specified address
+ * @note   Page tables that aren't present are skipped over as a whole
+ * @param  address: The address to start searching from
+ * @param  end: The address to stop searching at
+ * @retval The address of the first mapped page, or end if there are none
+ */
+void* mmu_next_mapped(void* address, void* end);
+
+/**
+ * @brief  Adds a range of physical memory to the direct map
+ * @note   Does nothing on architectures without a direct map (i386)
+ * @param  base: The physical base of the range
+ * @param  length: The length of the range, in bytes
+ */
+void mmu_map_direct(unsigned long base, size_t length);
+
+/**
+ * @brief  Gets the direct map address of some physical memory
+ * @param  address: The physical address
+ * @retval The linear address, or KNULL if the address isn't in the direct map
+ */
+void* mmu_phys_to_virt(unsigned long address);
+
 // MMU Context
 void mmu_switch_address_space(uint64_t page_context_base);
 paging_context_t* mmu_create_context();
@@ -130,6 +195,60 @@ void mmu_set_temp_context(paging_context_t* addr_context);
 void mmu_exit_temp_context();
 
 // Physical Memory Manager
+/**
+ * Physical memory zones, from the most to the least constrained
+ */
+enum mm_zone
+{
+    MM_ZONE_DMA = 0,    // Below 16MiB, for ISA DMA
+    MM_ZONE_32BIT,      // Below 4GiB, for 32-bit bus masters
+    MM_ZONE_64BIT,      // Anywhere
+    MM_ZONE_COUNT,
+};
+
+#define MM_MAX_NODES 64
+
+struct mm_zone_stats
+{
+    size_t total_pages;
+    size_t free_pages;
+    size_t largest_free;    // Pages in the largest free run
+};
+
+struct mm_stats
+{
+    size_t total_pages;     // Pages given to the allocator
+    size_t free_pages;      // Pages free in the buddy maps
+    size_t cached_pages;    // Free pages held in the frame caches
+    size_t reserved_pages;  // Pages reserved by the firmware or the kernel
+    size_t largest_free;    // Pages in the largest free run
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t alloc_pages;
+    uint64_t freed_pages;
+    uint64_t alloc_failures;
+    struct mm_zone_stats zones[MM_ZONE_COUNT];
+};
+
+struct mm_counters
+{
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t alloc_pages;
+    uint64_t freed_pages;
+    uint64_t alloc_failures;
+};
+
+struct mm_region_stats
+{
+    uint64_t base;
+    size_t free_pages;
+    size_t largest_free;    // Pages in the largest free block
+    unsigned int zone;
+    unsigned int node;
+    bool lazy;              // Buddy maps haven't been allocated yet
+};
+
 void mm_early_init();
 void mm_init();
 
@@ -144,8 +263,141 @@ void mm_init();
 void mm_add_area(unsigned long base, unsigned long length, uint32_t type);
 void mm_add_region(unsigned long base, size_t length, uint32_t type);
 unsigned long mm_alloc(size_t size);
+
+/**
+ * @brief  Allocates physical memory, preferably from the given NUMA node
+ * @note   Falls back onto the other nodes from the nearest to the furthest.
+ *         mm_alloc allocates from the current cpu's node.
+ * @param  size: The number of 4KiB pages to allocate
+ * @param  node: The node to allocate from
+ * @retval The physical address of the memory
+ */
+unsigned long mm_alloc_node(size_t size, unsigned int node);
+
+/**
+ * @brief  Allocates physical memory from a specific zone
+ * @note   Falls back onto the more constrained zones if the zone is full,
+ *         as long as they stay above their reserve.
+ *         Unlike mm_alloc, running out of memory is not fatal.
+ * @param  size: The number of 4KiB pages to allocate
+ * @param  zone: The least constrained zone the memory can come from
+ * @param  align: The alignment of the memory in 4KiB pages, as a power of 2
+ * @retval The physical address of the memory, or KNULL if none was found
+ */
+unsigned long mm_alloc_zone(size_t size, enum mm_zone zone, size_t align);
+
+/**
+ * @brief  Allocates physical memory which has been cleared to zero
+ * @note   Single pages are usually taken from a pool zeroed while idle
+ * @param  size: The number of 4KiB pages to allocate
+ * @retval The physical address of the memory
+ */
+unsigned long mm_alloc_zeroed(size_t size);
+
+/**
+ * @brief  Zeroes a page into the zeroed page pool
+ * @note   Meant to be called by the idle thread
+ * @retval True if a page was zeroed, false if there is nothing left to do
+ */
+bool mm_zero_pool_refill();
+
+/**
+ * @brief  Frees physical memory
+ * @note   A shared frame is only freed once every owner has freed it
+ * @param  addr: The physical address of the memory
+ * @param  size: The number of 4KiB pages to free
+ */
 void mm_free(unsigned long addr, size_t size);
 
+/**
+ * @brief  Adds another owner to a frame
+ * @note   Each owner has to free the frame before it is actually freed
+ *         Only single frames can be shared
+ * @param  frame: The physical address of the frame
+ */
+void mm_ref(unsigned long frame);
+
+/**
+ * @brief  Gets the number of owners of a frame
+ * @param  frame: The physical address of the frame
+ * @retval The number of owners, which is 1 for frames that aren't shared
+ */
+size_t mm_get_refs(unsigned long frame);
+
+/**
+ * @brief  Releases the reclaimable memory areas to the allocator
+ * @note   Can only be done once the firmware tables have been parsed
+ * @param  in_use: Checks if a frame is still being used, and should be kept.
+ *                 May be NULL
+ * @retval The number of 4KiB pages released
+ */
+size_t mm_reclaim(bool (*in_use)(unsigned long frame));
+
+/**
+ * @brief  Gets the current physical memory statistics
+ * @param  stats: The statistics to fill in
+ * @retval None
+ */
+void mm_get_stats(struct mm_stats* stats);
+
+/**
+ * @brief  Gets the allocation counters
+ * @note   Unlike mm_get_stats, the regions aren't walked, so this is cheap
+ *         enough to be called from an interrupt handler
+ * @param  counters: The counters to fill in
+ * @retval None
+ */
+void mm_get_counters(struct mm_counters* counters);
+
+/**
+ * @brief  Gets the statistics of the region after the given one
+ * @note   Regions are 128MiB, and ordered by when they were added
+ * @param  region: The region returned by the last call, or NULL for the first region
+ * @param  stats: The statistics to fill in
+ * @retval The region that the statistics are of, or NULL if there are no more regions
+ */
+void* mm_next_region_stats(void* region, struct mm_region_stats* stats);
+
+/**
+ * @brief  Starts sampling the allocation counters for the rates shown by
+ *         mm_format_info
+ * @note   Needs the default timer to be set up
+ * @retval None
+ */
+void mm_info_init();
+
+/**
+ * @brief  Formats the memory statistics into text
+ * @note   Rates are measured over the last second, and are shared by every
+ *         caller
+ * @param  buffer: The buffer to put the text in
+ * @param  length: The length of the buffer
+ * @param  regions: If the statistics of every region should be included
+ * @retval The length of the text, not including the null terminator
+ */
+size_t mm_format_info(char* buffer, size_t length, bool regions);
+
+/**
+ * @brief  Assigns a physical address range to a NUMA node
+ * @note   Nodes are tracked per 128MiB region, so regions which straddle
+ *         two nodes end up on the last one assigned
+ * @param  base: The base of the address range
+ * @param  length: The length of the address range
+ * @param  node: The node id
+ * @retval None
+ */
+void mm_set_node(uint64_t base, uint64_t length, unsigned int node);
+
+/**
+ * @brief  Sets the relative distance between two NUMA nodes
+ * @note   Distances are in SLIT units, where 10 is local
+ * @param  from: The node accessing the memory
+ * @param  to: The node the memory is on
+ * @param  distance: The relative distance
+ * @retval None
+ */
+void mm_set_node_distance(unsigned int from, unsigned int to, uint8_t distance);
+
 void heap_init();
 
 #endif /* __MM_H__ */
@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/types.h>
+
+#ifndef __SLAB_H__
+#define __SLAB_H__ 1
+
+// Puts an object into its constructed state
+typedef void (*kmem_ctor_t)(void* object);
+
+struct kmem_slab;
+
+/**
+ * A cache of objects of one type
+ */
+typedef struct kmem_cache
+{
+    const char* name;
+    size_t object_size;
+    size_t align;
+    kmem_ctor_t ctor;
+
+    // Filled in when the first slab is made
+    size_t slab_size;                   // Size of each slab, as a power of two
+    size_t slab_objects;                // Objects in each slab
+
+    struct kmem_slab* partial;          // Slabs with some free objects
+    struct kmem_slab* full;             // Slabs without any free objects
+    struct kmem_slab* empty;            // Slabs without any allocated objects
+    struct kmem_cache* next;            // Next cache in the list of all caches
+    bool listed;
+
+    // Stats
+    size_t alloc_count;
+    size_t free_count;
+    size_t active_objects;
+    size_t total_objects;
+    size_t slab_count;
+} kmem_cache_t;
+
+/**
+ * Statically defines a cache
+ * The cache is set up on its first allocation, so it can be used without
+ * calling kmem_cache_create
+ */
+#define KMEM_CACHE_INIT(cache_name, size, alignment, constructor) \
+    { .name = (cache_name), .object_size = (size), .align = (alignment), .ctor = (constructor) }
+
+/**
+ * @brief  Creates a cache of objects
+ * @note   Constructors are only called when a slab is made, so objects must
+ *         be put back into their constructed state before being freed
+ * @param  cache: The cache to initialize
+ * @param  name: The name of the cache
+ * @param  size: The size of each object
+ * @param  align: The alignment of each object, or 0 for pointer alignment
+ * @param  ctor: The constructor of the objects, or NULL for none
+ */
+void kmem_cache_create(kmem_cache_t* cache, const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+
+/**
+ * @brief  Allocates an object from the cache
+ * @param  cache: The cache to allocate from
+ * @retval The constructed object
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+/**
+ * @brief  Returns an object to the cache
+ * @param  cache: The cache the object was allocated from
+ * @param  object: The object to free
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+/**
+ * @brief  Formats the statistics of every cache into a buffer
+ * @param  buffer: The buffer to write the statistics into
+ * @param  length: The length of the buffer
+ * @retval The number of bytes written, excluding the null terminator
+ */
+size_t kmem_format_info(char* buffer, size_t length);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/types.h>
+#include <common/tasks/tasks.h>
+
+#ifndef __VMA_H__
+#define __VMA_H__ 1
+
+/**
+ * A reserved region of a process's address space
+ * Pages in the area are allocated & zeroed on their first access, and may be
+ * shared with forked processes until written to
+ */
+struct vm_area
+{
+    struct vm_area* next;   // Next area, in address order
+    uintptr_t base;
+    uintptr_t end;
+    uint32_t flags;         // Flags the pages are mapped with (see MMU_ACCESS_xxx & MMU_CACHE_xxx)
+};
+
+/**
+ * @brief  Reserves a region of the process's address space
+ * @note   No memory is allocated until the pages are accessed
+ * @param  process: The process to reserve the region in
+ * @param  address: The base of the region
+ * @param  size: The size of the region, in bytes
+ * @param  flags: The flags the pages will be mapped with
+ * @retval See MMU_MAPPING_xxx error codes. MMU_MAPPING_EXISTS is returned if
+ *         the region overlaps an existing area
+ */
+int vma_reserve(process_t* process, void* address, size_t size, uint32_t flags);
+
+/**
+ * @brief  Releases a region of the process's address space
+ * @note   Any pages that were faulted in are unmapped & freed. The process
+ *         must be the active one
+ * @param  process: The process to release the region from
+ * @param  address: The base of the region
+ * @param  size: The size of the region, in bytes
+ */
+void vma_release(process_t* process, void* address, size_t size);
+
+/**
+ * @brief  Changes the flags of a region of the process's address space
+ * @note   Pages already faulted in are changed too. The process must be the
+ *         active one
+ * @param  process: The process to change the region of
+ * @param  address: The base of the region
+ * @param  size: The size of the region, in bytes
+ * @param  flags: The new flags of the region
+ * @retval See MMU_MAPPING_xxx error codes
+ */
+int vma_protect(process_t* process, void* address, size_t size, uint32_t flags);
+
+/**
+ * @brief  Finds the area containing an address
+ * @param  process: The process to search in
+ * @param  address: The address to look for
+ * @retval The area containing the address, or NULL if there is none
+ */
+struct vm_area* vma_find(process_t* process, void* address);
+
+/**
+ * @brief  Duplicates a process's areas into a new process
+ * @note   Pages that were faulted in are shared read-only by both processes,
+ *         and are copied by whichever one writes to them first. The parent
+ *         must be the active process
+ * @param  parent: The process to duplicate
+ * @param  child: The new process, which must not have any areas
+ * @retval See MMU_MAPPING_xxx error codes
+ */
+int vma_fork(process_t* parent, process_t* child);
+
+/**
+ * @brief  Frees all of a process's areas
+ * @note   The pages in the areas are left mapped, and are freed when the
+ *         process's address space is destroyed
+ * @param  process: The process to free the areas of
+ */
+void vma_destroy(process_t* process);
+
+/**
+ * @brief  Handles a page fault inside of an area
+ * @note   Called from the page fault handler. Pages that aren't present are
+ *         allocated, and writes to shared pages copy the page
+ * @param  address: The faulting address
+ * @param  access: The type of access that faulted (see MMU_ACCESS_xxx)
+ * @param  was_present: If the page was present
+ * @retval True if the fault was handled, false if the access is invalid
+ */
+bool vma_handle_fault(void* address, uint32_t access, bool was_present);
+
+#endif /* __VMA_H__ */
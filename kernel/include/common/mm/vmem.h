@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/types.h>
+
+#ifndef __VMEM_H__
+#define __VMEM_H__ 1
+
+#define VMEM_FREELISTS      (sizeof(uintptr_t) * 8)
+#define VMEM_HASH_SIZE      64
+#define VMEM_QCACHE_MAX     8   // Largest quantum cache, in quanta
+#define VMEM_QCACHE_DEPTH   16  // Allocations held by each quantum cache
+
+struct vmem_seg;
+
+/**
+ * An arena of virtual address space
+ */
+typedef struct vmem
+{
+    const char* name;
+    uintptr_t base;
+    size_t size;
+    size_t quantum;
+    size_t qcache_max;                              // Largest size served by the quantum caches
+
+    struct vmem_seg* segments;                      // All segments, in address order
+    struct vmem_seg* freelist[VMEM_FREELISTS];      // Free segments, by power of two size
+    struct vmem_seg* hash[VMEM_HASH_SIZE];          // Allocated segments, by base
+
+    struct
+    {
+        size_t count;
+        uintptr_t entries[VMEM_QCACHE_DEPTH];
+    } qcache[VMEM_QCACHE_MAX];
+
+    // Stats
+    size_t in_use;          // Bytes allocated from the segments, including those held by the quantum caches
+    size_t alloc_count;
+    size_t fail_count;
+} vmem_t;
+
+// Kernel arenas
+extern vmem_t io_arena;         // Device mappings & other dynamic kernel mappings
+extern vmem_t kstack_arena;     // Kernel thread stacks
+
+/**
+ * @brief  Creates an arena over a range of addresses
+ * @note   Allocations which are up to qcache_max bytes are cached per size,
+ *         to keep the segment lists short
+ * @param  arena: The arena to initialize
+ * @param  name: The name of the arena
+ * @param  base: The base of the range
+ * @param  size: The size of the range, in bytes
+ * @param  quantum: The allocation granularity
+ * @param  qcache_max: The largest allocation size to cache, or 0 for none
+ */
+void vmem_create(vmem_t* arena, const char* name, uintptr_t base, size_t size, size_t quantum, size_t qcache_max);
+
+/**
+ * @brief  Allocates a range of addresses from the arena
+ * @param  arena: The arena to allocate from
+ * @param  size: The size of the allocation, rounded up to the quantum
+ * @retval The base of the allocation, or KNULL if the arena is exhausted
+ */
+void* vmem_alloc(vmem_t* arena, size_t size);
+
+/**
+ * @brief  Allocates an aligned range of addresses from the arena
+ * @param  arena: The arena to allocate from
+ * @param  size: The size of the allocation, rounded up to the quantum
+ * @param  align: The alignment of the base, as a power of two
+ * @retval The base of the allocation, or KNULL if the arena is exhausted
+ */
+void* vmem_xalloc(vmem_t* arena, size_t size, size_t align);
+
+/**
+ * @brief  Returns a range of addresses to the arena
+ * @note   The address and size must be the same as the allocation's
+ * @param  arena: The arena the range was allocated from
+ * @param  address: The base of the allocation
+ * @param  size: The size of the allocation
+ */
+void vmem_free(vmem_t* arena, void* address, size_t size);
+
+/**
+ * @brief  Sets up the kernel arenas
+ * @note   Must be called once the physical memory manager is ready
+ */
+void vmem_init();
+
+// IO Mappings
+/**
+ * @brief  Maps a range of physical addresses into the kernel's address space
+ * @param  address: The physical address to map
+ * @param  size: The size of the range, in bytes
+ * @param  flags: The access & caching flags of the mapping (see MMU_ACCESS_xxx & MMU_CACHE_xxx)
+ * @retval The linear address of the physical address, or KNULL if it couldn't be mapped
+ */
+void* ioremap(unsigned long address, size_t size, uint32_t flags);
+
+/**
+ * @brief  Unmaps a range mapped by ioremap
+ * @param  address: The linear address returned by ioremap
+ * @param  size: The size given to ioremap
+ */
+void iounmap(void* address, size_t size);
+
+#endif /* __VMEM_H__ */
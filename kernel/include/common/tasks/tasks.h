@@ -7,6 +7,7 @@
 #define THREAD_STACK_SIZE 4096*4
 
 struct thread;
+struct vm_area;
 
 struct thread_queue
 {
@@ -49,6 +50,7 @@ typedef struct process
 
     // TODO: Do we want to implement separate address spaces for exploit mitigation?
     paging_context_t* page_context_base;
+    struct vm_area* vm_areas;   // Reserved regions of the address space, in address order
 } process_t;
 
 typedef struct thread
@@ -80,7 +82,23 @@ typedef struct thread
 
 void tasks_init(char* init_name, void* init_entry);
 process_t* process_create(const char *name);
+process_t* process_fork(const char *name);
+void process_destroy(process_t *process);
 thread_t* thread_create(process_t *parent, void *entry_point, enum thread_priority priority, const char* name, void* params);
 void thread_destroy(thread_t *thread);
 
+/**
+ * @brief  Allocates a mapped kernel stack, with an unmapped guard page below it
+ * @note   Stacks of exited threads are reused before allocating new ones
+ * @retval The top of the stack
+ */
+unsigned long kstack_alloc();
+
+/**
+ * @brief  Frees a kernel stack allocated by kstack_alloc
+ * @note   Stacks not from kstack_alloc (e.g. the boot stack) are ignored
+ * @param  stacktop: The top of the stack
+ */
+void kstack_free(unsigned long stacktop);
+
 #endif /* __TASKS_H__ */
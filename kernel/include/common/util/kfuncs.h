@@ -19,6 +19,7 @@
  */
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <common/util/klog.h>
 
 #ifndef __KFUNCS_H__
@@ -30,4 +31,15 @@ void __attribute__((noreturn)) kpanic_intr(struct intr_stack *stack, const char*
 void __attribute__((noreturn)) kvpanic(const char* message_string, va_list args);
 void __attribute__((noreturn)) kvpanic_intr(struct intr_stack *stack, const char* message_string, va_list args);
 
+/**
+ * @brief  Appends formatted text to a buffer, stopping when it is full
+ * @note   The text is always null terminated, as long as the buffer isn't empty
+ * @param  buffer: The buffer to append to
+ * @param  length: The length of the buffer
+ * @param  index: Where the text so far ends
+ * @param  format: The format of the text to append
+ * @retval Where the text now ends, which is at most length - 1
+ */
+size_t kappendf(char* buffer, size_t length, size_t index, const char* format, ...);
+
 #endif /* __KFUNCS_H__ */
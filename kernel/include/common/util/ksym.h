@@ -0,0 +1,51 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ *
+ * This file is part of Kernel4.
+ *
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <common/types.h>
+
+#ifndef __KSYM_H__
+#define __KSYM_H__ 1
+
+// Symbol table made by gen_syms.sh, placed in the initrd by build_arch_cmake.sh
+#if defined(__x86_64__)
+#define KSYM_FILE "/boot/k4-x86_64.sym"
+#else
+#define KSYM_FILE "/boot/k4-i386.sym"
+#endif
+
+/**
+ * @brief  Loads the kernel's symbol table
+ * @note   Does nothing if the symbols are already loaded
+ * @param  path: The path of the symbol table, in the format made by gen_syms.sh
+ * @retval True if the symbols are loaded
+ */
+bool ksym_load(const char* path);
+
+/**
+ * @brief  Finds the function containing an address
+ * @param  address: The address to look up
+ * @param  offset: Where to store the offset of the address from the symbol,
+ *         or NULL
+ * @retval The name of the function, or NULL if the symbols aren't loaded or
+ *         the address is before the first symbol
+ */
+const char* ksym_lookup(uintptr_t address, uintptr_t* offset);
+
+#endif /* __KSYM_H__ */
@@ -11,3 +11,7 @@ TARGET_ARCH=$1
 cmake -E make_directory build/$TARGET_ARCH
 cmake -E chdir build/$TARGET_ARCH cmake ../../ -DTARGET_ARCH=$TARGET_ARCH -DCMAKE_TOOLCHAIN_FILE=toolchains/toolchain-cross.cmake
 cmake -E chdir build/$TARGET_ARCH make
+
+# Symbol table for the kernel, read from the initrd
+mkdir -p sysroot/boot
+./gen_syms.sh build/$TARGET_ARCH/kernel/k4-$TARGET_ARCH.kern sysroot/boot/k4-$TARGET_ARCH
@@ -5,5 +5,7 @@ echo "Generating initrd"
 mkdir -p initrd/initrd
 
 cd sysroot
+# Mount points
+mkdir -p dev proc
 find * | awk '!/(include)|(lib)|(\.[oha])/' - | pax -w -Ld -M 0x008F > ../initrd/initrd/initrd.tar
 tar -tf ../initrd/initrd/initrd.tar
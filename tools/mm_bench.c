@@ -0,0 +1,313 @@
+/**
+ * Copyright (C) 2018 DropDemBits
+ * 
+ * This file is part of Kernel4.
+ * 
+ * Kernel4 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * Kernel4 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Kernel4.  If not, see <http://www.gnu.org/licenses/>.
+ * 
+ */
+
+/*
+ * Host-side benchmark of the physical memory allocator.
+ * The kernel's buddy allocator is built into the benchmark along with the
+ * bitmap allocator it replaced, and both are timed over one 128MiB region.
+ * The buddy maps are used directly, so the per-cpu frame caches don't hide
+ * the cost of the allocator itself.
+ *
+ * Built and run with "make bench-mm" from the top of the tree.
+ */
+
+// The host's ino_t clashes with the kernel's
+#define ino_t host_ino_t
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#undef ino_t
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Interrupts don't exist here
+#define __CPUFUNCS_H__
+typedef uint64_t cpu_flags_t;
+static inline cpu_flags_t hal_disable_interrupts() { return 0; }
+static inline void hal_enable_interrupts(cpu_flags_t flags) { (void)flags; }
+
+#include "../kernel/core/mm/mm.c"
+#include "../kernel/core/mm/vmem.c"
+
+#define BENCH_ROUNDS 1000
+#define BENCH_BLOCKS 64
+#define BENCH_SPACE (64 << 20)
+
+uintptr_t kernel_phystart = 0x100000;
+size_t kernel_physize = 0x100000;
+uintptr_t kernel_phypage_end = 0x200000;
+uint32_t initrd_start = 0xDEADBEEF;
+uint32_t initrd_size = 0;
+
+// Stands in for the virtual address space used by the allocator
+static void* bench_space = NULL;
+
+void* mm_get_base() { return bench_space; }
+unsigned int hal_get_cpu_node() { return 0; }
+void heap_init() {}
+
+// Everything is already backed by bench_space
+int mmu_map(void* address, unsigned long mapping, uint32_t flags) { return 0; }
+int mmu_map_range(void* address, unsigned long mapping, size_t size, uint32_t flags) { return 0; }
+bool mmu_unmap(void* address, bool erase_entry) { return true; }
+void mmu_unmap_range(void* address, size_t size, bool erase_entry) {}
+void mmu_map_direct(unsigned long base, size_t length) {}
+void* mmu_phys_to_virt(unsigned long address) { return KNULL; }
+
+void klog_logln(enum klog_level level, const char* format, ...) {}
+
+void kpanic(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fputs("panic: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+/*
+ * The bitmap allocator which the buddy allocator replaced, over a scratch
+ * bitmap of one region
+ */
+static uint64_t scratch_bitmap[512];
+static uint64_t scratch_super_map = 0;
+
+typedef union
+{
+    struct
+    {
+        uint16_t bit_index : 6;
+        uint16_t qword_index : 9;
+    };
+    uint16_t value;
+} bm_index_t;
+
+typedef union
+{
+    struct
+    {
+        uint16_t padding : 9;
+        uint16_t bit_index : 6;
+    };
+    uint16_t value;
+} sbm_index_t;
+
+static void bm_set_bit(size_t index)
+{
+    bm_index_t bm_index = {.value = index};
+    sbm_index_t sbm_index = {.value = index};
+
+    scratch_bitmap[bm_index.qword_index] |= (1ULL << bm_index.bit_index);
+
+    // Check superblocks
+    for(uint16_t i = 0; i < 0b111; i++)
+    {
+        if(scratch_bitmap[(bm_index.qword_index & ~0x7ULL) + i] != ~0ULL)
+            return;
+    }
+
+    scratch_super_map |= (1ULL << sbm_index.bit_index);
+}
+
+static void bm_clear_bit(size_t index)
+{
+    bm_index_t bm_index = {.value = index};
+    sbm_index_t sbm_index = {.value = index};
+
+    scratch_bitmap[bm_index.qword_index] &= ~(1ULL << bm_index.bit_index);
+    scratch_super_map &= ~(1ULL << sbm_index.bit_index);
+}
+
+static uint8_t bm_get_bit(size_t index)
+{
+    bm_index_t bm_index = {.value = index};
+    return (uint8_t) (scratch_bitmap[bm_index.qword_index] >> (bm_index.bit_index)) & 0x1;
+}
+
+static size_t bm_find_free_bits(size_t size)
+{
+    bm_index_t index = {.value = 0xFFFF};
+    sbm_index_t sbm_index = {.value = 0x0000};
+    size_t num_free_bits = 0;
+
+    for(size_t sb_index = 0; sb_index < 64; sb_index++)
+    {
+        if(((scratch_super_map >> sb_index) & 0x1) == 0)
+        {
+            sbm_index.bit_index = sb_index;
+            index.value = sbm_index.bit_index;
+
+            for(size_t i = 0; i < 512; i++)
+            {
+                index.bit_index = i & 0x3F;
+                index.qword_index = (i >> 6) | (sbm_index.value >> 6);
+
+                if(bm_get_bit(index.value) == 0)
+                {
+                    if(++num_free_bits >= size) break;
+                } else
+                {
+                    num_free_bits = 0;
+                }
+            }
+        }
+
+        if(num_free_bits == 0) index.value = 0xFFFF;
+        else if(num_free_bits >= size) break;
+    }
+
+    return (size_t)index.value;
+}
+
+static unsigned long bitmap_alloc(size_t size)
+{
+    size_t bit_index = bm_find_free_bits(size);
+
+    if(bit_index == 0xFFFF)
+        kpanic("Bitmap allocator ran out of space");
+
+    // Set bits in bitmap
+    for(size_t i = 0; i < size; i++)
+        bm_set_bit(bit_index + i);
+
+    return bit_index;
+}
+
+static void bitmap_free(unsigned long bit_index, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+        bm_clear_bit(bit_index + i);
+}
+
+/*
+ * The buddy allocator, restricted to the benchmark region
+ */
+static unsigned long buddy_alloc_frames(size_t size)
+{
+    unsigned long frame = region_alloc(size, 1, 2, 1, BLOCK_PAGES);
+
+    if(frame == (unsigned long)KNULL)
+        kpanic("Buddy allocator ran out of space");
+
+    return frame;
+}
+
+static void buddy_free_frames(unsigned long frame, size_t size)
+{
+    region_free(index_lookup(frame), frame, size);
+}
+
+struct bench_allocator
+{
+    const char* name;
+    unsigned long (*alloc)(size_t size);
+    void (*free)(unsigned long addr, size_t size);
+};
+
+static uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Allocates and frees a batch of blocks of the given size, over and over
+ * Returns the average time taken by one allocation and free, in nanoseconds
+ */
+static uint64_t bench_batch(struct bench_allocator* allocator, size_t size, bool reverse)
+{
+    unsigned long blocks[BENCH_BLOCKS];
+    uint64_t start = bench_now();
+
+    for(int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for(int i = 0; i < BENCH_BLOCKS; i++)
+            blocks[i] = allocator->alloc(size);
+
+        for(int i = 0; i < BENCH_BLOCKS; i++)
+        {
+            int block = reverse ? BENCH_BLOCKS - 1 - i : i;
+            allocator->free(blocks[block], size);
+        }
+    }
+
+    return (bench_now() - start) / (BENCH_ROUNDS * BENCH_BLOCKS);
+}
+
+/*
+ * Same as bench_batch, but with every other page of the first half of the
+ * region taken, so that small holes have to be skipped over
+ */
+static uint64_t bench_fragmented(struct bench_allocator* allocator, size_t size)
+{
+    static unsigned long pinned[BLOCK_PAGES / 2];
+
+    for(size_t i = 0; i < BLOCK_PAGES / 2; i++)
+        pinned[i] = allocator->alloc(1);
+
+    for(size_t i = 0; i < BLOCK_PAGES / 2; i += 2)
+        allocator->free(pinned[i], 1);
+
+    uint64_t time = bench_batch(allocator, size, true);
+
+    for(size_t i = 1; i < BLOCK_PAGES / 2; i += 2)
+        allocator->free(pinned[i], 1);
+
+    return time;
+}
+
+int main()
+{
+    bench_space = aligned_alloc(PAGE_SIZE, BENCH_SPACE);
+
+    if(bench_space == NULL)
+        kpanic("Unable to allocate the benchmark space");
+
+    memset(bench_space, 0, BENCH_SPACE);
+
+    // Low memory for the kernel, and a whole region to benchmark
+    mm_add_area(0x0, BLOCK_PAGES << BASE_SHIFT, MEM_REGION_AVAILABLE);
+    mm_add_area(1UL << BLOCK_SHIFT, BLOCK_PAGES << BASE_SHIFT, MEM_REGION_AVAILABLE);
+    mm_early_init();
+
+    struct bench_allocator allocators[] = {
+        { "bitmap", bitmap_alloc, bitmap_free },
+        { "buddy", buddy_alloc_frames, buddy_free_frames },
+    };
+
+    printf("%-8s %10s %10s %12s\n", "", "1 page", "17 pages", "fragmented");
+
+    for(size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+    {
+        struct bench_allocator* allocator = &allocators[i];
+        uint64_t single = bench_batch(allocator, 1, false);
+        uint64_t multi = bench_batch(allocator, 17, true);
+        uint64_t fragmented = bench_fragmented(allocator, 17);
+
+        printf("%-8s %8luns %8luns %10luns\n", allocator->name, single, multi, fragmented);
+    }
+
+    return 0;
+}